@@ -0,0 +1,127 @@
+#include <SDL2/SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <d3d9.h>
+#include <d3d9_sdl.h>
+
+/* Measures the latency of IDirect3DDevice9::Reset().
+ *
+ * Usage: sdl-nine-bench-reset [iterations] [fullscreen]
+ */
+
+#define SCREEN_WIDTH 800
+#define SCREEN_HEIGHT 600
+
+struct stats
+{
+    double min, max, sum;
+    int count;
+};
+
+static void stats_add(struct stats *s, double ms)
+{
+    if (!s->count || ms < s->min)
+        s->min = ms;
+    if (!s->count || ms > s->max)
+        s->max = ms;
+    s->sum += ms;
+    s->count++;
+}
+
+static void stats_print(const char *name, const struct stats *s)
+{
+    if (!s->count)
+        return;
+
+    printf("%-24s avg %8.3f ms  min %8.3f ms  max %8.3f ms  (%d resets)\n",
+           name, s->sum / s->count, s->min, s->max, s->count);
+}
+
+static BOOL timed_reset(LPDIRECT3DDEVICE9 dev, D3DPRESENT_PARAMETERS *pp, struct stats *s)
+{
+    D3DPRESENT_PARAMETERS copy = *pp;
+    Uint64 start, end;
+    HRESULT hr;
+
+    start = SDL_GetPerformanceCounter();
+    hr = dev->Reset(&copy);
+    end = SDL_GetPerformanceCounter();
+
+    if (FAILED(hr))
+    {
+        fprintf(stderr, "Reset failed with 0x%08x\n", (unsigned)hr);
+        return FALSE;
+    }
+
+    stats_add(s, (double)(end - start) * 1000.0 / SDL_GetPerformanceFrequency());
+    return TRUE;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 100;
+    BOOL fullscreen = argc > 2 && !strcmp(argv[2], "fullscreen");
+    struct stats same = {}, resize = {};
+    LPDIRECT3D9 d3d;
+    LPDIRECT3DDEVICE9 dev;
+    D3DPRESENT_PARAMETERS pp;
+    int i;
+
+    if (SDL_Init(SDL_INIT_VIDEO) != 0)
+        return -1;
+
+    SDL_Window *window = SDL_CreateWindow("Gallium Nine SDL Reset benchmark",
+                                          SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+                                          SCREEN_WIDTH, SCREEN_HEIGHT, 0);
+    if (!window)
+        return -1;
+
+    d3d = Direct3DCreate9(D3D_SDK_VERSION);
+    if (!d3d)
+        return -1;
+
+    memset(&pp, 0, sizeof(pp));
+    pp.Windowed = !fullscreen;
+    pp.SwapEffect = D3DSWAPEFFECT_DISCARD;
+    pp.hDeviceWindow = window;
+    pp.BackBufferFormat = D3DFMT_X8R8G8B8;
+    pp.BackBufferWidth = SCREEN_WIDTH;
+    pp.BackBufferHeight = SCREEN_HEIGHT;
+    pp.BackBufferCount = 1;
+
+    if (FAILED(d3d->CreateDevice(D3DADAPTER_DEFAULT, D3DDEVTYPE_HAL, window,
+                                 D3DCREATE_SOFTWARE_VERTEXPROCESSING, &pp, &dev)))
+    {
+        fprintf(stderr, "CreateDevice failed\n");
+        return -1;
+    }
+
+    /* Reset with unchanged parameters, the common case after a device loss */
+    for (i = 0; i < iterations; ++i)
+    {
+        if (!timed_reset(dev, &pp, &same))
+            break;
+        dev->Present(NULL, NULL, NULL, NULL);
+    }
+
+    /* Windowed only: alternate between two back buffer sizes */
+    for (i = 0; !fullscreen && i < iterations; ++i)
+    {
+        pp.BackBufferWidth = (i & 1) ? SCREEN_WIDTH : 1024;
+        pp.BackBufferHeight = (i & 1) ? SCREEN_HEIGHT : 768;
+        if (!timed_reset(dev, &pp, &resize))
+            break;
+        dev->Present(NULL, NULL, NULL, NULL);
+    }
+
+    stats_print("unchanged parameters", &same);
+    stats_print("back buffer resize", &resize);
+
+    dev->Release();
+    d3d->Release();
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+
+    return 0;
+}
@@ -5,6 +5,7 @@
 
 #define NINE_ATTR_PRINTF(index, check) __attribute__((format(printf, index, check)))
 #define NINE_ATTR_ALIGNED(alignment) __attribute__((aligned(alignment)))
+#define NINE_ATTR_CONSTRUCTOR __attribute__((constructor))
 
 #define ZeroMemory(p, s) memset(p, 0, s)
 #define IsEqualGUID(a, b) !memcmp(a, b, sizeof(GUID))
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <dlfcn.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <string.h>
 
@@ -31,8 +32,22 @@ static void *open_d3dadapter(char *paths, char **res, char **err)
         len = next - p;
         snprintf(path, sizeof(path), "%.*s", len, p);
 
-        if (!stat(path, &st) && S_ISDIR(st.st_mode))
+        /* bare library names are left to dlopen's search */
+        if (strchr(path, '/') && stat(path, &st))
+        {
+            TRACE("Skipping nonexistent '%s'\n", path);
+            continue;
+        }
+
+        if (strchr(path, '/') && S_ISDIR(st.st_mode))
+        {
             strcat(path, "/" D3DADAPTER9);
+            if (stat(path, &st))
+            {
+                TRACE("Skipping nonexistent '%s'\n", path);
+                continue;
+            }
+        }
 
         TRACE("Trying to load '%s'\n", path);
         handle = dlopen(path, RTLD_GLOBAL | RTLD_NOW);
@@ -65,9 +80,9 @@ static void *open_d3dadapter(char *paths, char **res, char **err)
     return handle;
 }
 
-void *common_load_d3dadapter(char **path, char **err)
+static void *load_d3dadapter(char **path, char **err)
 {
-    static void *handle = NULL;
+    void *handle = NULL;
     char *env;
 
     env = getenv("D3D_MODULE_PATH");
@@ -106,3 +121,45 @@ void *common_load_d3dadapter(char **path, char **err)
     return handle;
 #endif
 }
+
+/* The search and dlopen of the huge driver is done once, either by the
+ * first caller or ahead of time on a preload thread. */
+static pthread_once_t load_once = PTHREAD_ONCE_INIT;
+static void *load_handle;
+static char *load_path;
+static char *load_err;
+
+static void load_d3dadapter_once(void)
+{
+    load_handle = load_d3dadapter(&load_path, &load_err);
+}
+
+static void *preload_thread(void *arg)
+{
+    pthread_once(&load_once, load_d3dadapter_once);
+    return NULL;
+}
+
+void common_preload_d3dadapter(void)
+{
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, preload_thread, NULL))
+    {
+        WARN("Failed to create preload thread\n");
+        return;
+    }
+    pthread_detach(thread);
+}
+
+void *common_load_d3dadapter(char **path, char **err)
+{
+    pthread_once(&load_once, load_d3dadapter_once);
+
+    if (path)
+        *path = load_path ? strdup(load_path) : NULL;
+    if (err)
+        *err = load_err ? strdup(load_err) : NULL;
+
+    return load_handle;
+}
@@ -3,6 +3,10 @@
 #ifndef __COMMON_LIBRARY_H
 #define __COMMON_LIBRARY_H
 
+/* loads the driver once, the handle is shared by all callers */
 void *common_load_d3dadapter(char **path, char **err);
 
+/* start loading the driver on a background thread */
+void common_preload_d3dadapter(void);
+
 #endif /* __COMMON_LIBRARY_H */
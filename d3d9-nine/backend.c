@@ -9,8 +9,14 @@
 
 #include <d3d9types.h>
 #include <X11/Xlib-xcb.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <SDL2/SDL.h>
 
 #include "../common/debug.h"
 #include "backend.h"
@@ -20,15 +26,54 @@ extern const struct dri_backend_funcs dri3_funcs;
 #ifdef D3D9NINE_DRI2
 extern const struct dri_backend_funcs dri2_funcs;
 #endif
+#ifdef D3D9NINE_SHM
+extern const struct dri_backend_funcs shm_funcs;
+#endif
+extern const struct dri_backend_funcs headless_funcs;
 
-static const struct dri_backend_funcs *backends[] = {
+static const struct dri_backend_funcs *const default_backends[] = {
     &dri3_funcs,
 #ifdef D3D9NINE_DRI2
     &dri2_funcs,
 #endif
+#ifdef D3D9NINE_SHM
+    &shm_funcs,
+#endif
+    &headless_funcs,
 };
 
-static const int backends_count = sizeof(backends) / sizeof(*backends);
+static const struct dri_backend_funcs *const *backends = default_backends;
+static int backends_count = sizeof(default_backends) / sizeof(*default_backends);
+
+void backend_set_funcs(const struct dri_backend_funcs *const *funcs, int count)
+{
+    backends = funcs ? funcs : default_backends;
+    backends_count = funcs ? count : sizeof(default_backends) / sizeof(*default_backends);
+}
+
+/* The instance created and initialized by backend_probe is kept and
+ * handed to the first backend_create for the same display and screen,
+ * so the backend isn't set up twice at startup. The preload thread and
+ * several IDirect3D9 objects may probe and create concurrently, probed is
+ * only accessed with probed_lock held and claimed before it's used. */
+struct probed_backend {
+    const struct dri_backend_funcs *funcs;
+    struct dri_backend_priv *priv;
+    Display *dpy;
+    int screen;
+};
+
+static SDL_SpinLock probed_lock;
+static struct probed_backend probed;
+
+static void backend_destroy_probed(struct probed_backend *old)
+{
+    if (!old->priv)
+        return;
+
+    old->funcs->deinit(old->priv);
+    old->funcs->destroy(old->priv);
+}
 
 static const char *backend_getenv()
 {
@@ -44,22 +89,40 @@ static const char *backend_getenv()
     return env;
 }
 
+/* backends that don't present to X are only used when D3D_BACKEND asks for them */
+static BOOL backend_skip(int i, const char *env)
+{
+    if (env)
+        return strcmp(env, backends[i]->name) != 0;
+
+    return backends[i]->present_buffer != NULL;
+}
+
+BOOL backend_is_headless(void)
+{
+    const char *env = backend_getenv();
+
+    return env && !strcmp(env, headless_funcs.name);
+}
+
 BOOL backend_probe(Display *dpy)
 {
-    int i;
+    int i, screen;
     const char *env;
     struct dri_backend_priv *p;
+    struct probed_backend old;
 
     TRACE("dpy=%p\n", dpy);
 
-    if (!dpy)
+    if (!dpy && !backend_is_headless())
         return FALSE;
 
     env = backend_getenv();
+    screen = dpy ? DefaultScreen(dpy) : 0;
 
     for (i = 0; i < backends_count; ++i)
     {
-        if (env && strcmp(env, backends[i]->name))
+        if (backend_skip(i, env))
             continue;
 
         if (!backends[i]->probe(dpy))
@@ -68,7 +131,7 @@ BOOL backend_probe(Display *dpy)
             continue;
         }
 
-        if (!backends[i]->create(dpy, DefaultScreen(dpy), &p))
+        if (!backends[i]->create(dpy, screen, NULL, &p))
         {
             TRACE("Error creating backend %s\n", backends[i]->name);
             continue;
@@ -81,9 +144,17 @@ BOOL backend_probe(Display *dpy)
             continue;
         }
 
-        backends[i]->destroy(p);
+        SDL_AtomicLock(&probed_lock);
+        old = probed;
+        probed.funcs = backends[i];
+        probed.priv = p;
+        probed.dpy = dpy;
+        probed.screen = screen;
+        SDL_AtomicUnlock(&probed_lock);
+
+        backend_destroy_probed(&old);
 
-        if (i != 0)
+        if (i != 0 && !backends[i]->present_buffer)
             fprintf(stderr, "\033[1;31mDRI3 backend not active (slower performance)\033[0m\n");
 
         return TRUE;
@@ -92,13 +163,225 @@ BOOL backend_probe(Display *dpy)
     return FALSE;
 }
 
-struct dri_backend *backend_create(Display *dpy, int screen)
+/* platform devices like vgem are tagged like udev's ID_PATH_TAG, platform-vgem */
+static BOOL backend_platform_device_info(const char *device, struct dri_device *dev)
+{
+    char target[PATH_MAX];
+    const char *name;
+
+    if (!realpath(device, target) || !strstr(target, "/platform/"))
+        return FALSE;
+
+    name = strrchr(target, '/');
+    snprintf(dev->tag, sizeof(dev->tag), "platform-%s", name ? name + 1 : target);
+
+    return TRUE;
+}
+
+/* reads PCI_ID and PCI_SLOT_NAME of a DRM character device from sysfs,
+ * falls back to the platform device name */
+static BOOL backend_device_info(dev_t rdev, struct dri_device *dev)
+{
+    char path[PATH_MAX], line[128];
+    char slot[32] = "";
+    FILE *f;
+    int i;
+
+    snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device/uevent",
+             major(rdev), minor(rdev));
+    f = fopen(path, "r");
+    if (!f)
+        return FALSE;
+
+    while (fgets(line, sizeof(line), f))
+    {
+        if (!strncmp(line, "PCI_ID=", 7))
+            sscanf(line + 7, "%x:%x", &dev->vendor_id, &dev->device_id);
+        else if (!strncmp(line, "PCI_SLOT_NAME=", 14))
+            sscanf(line + 14, "%31s", slot);
+    }
+    fclose(f);
+
+    if (!slot[0])
+    {
+        snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device", major(rdev), minor(rdev));
+        return backend_platform_device_info(path, dev);
+    }
+
+    /* 0000:01:00.0 -> pci-0000_01_00_0 */
+    snprintf(dev->tag, sizeof(dev->tag), "pci-%s", slot);
+    for (i = 4; dev->tag[i]; ++i)
+    {
+        if (dev->tag[i] == ':' || dev->tag[i] == '.')
+            dev->tag[i] = '_';
+    }
+
+    return TRUE;
+}
+
+static int backend_compare_devices(const void *a, const void *b)
+{
+    const struct dri_device *da = a, *db = b;
+    size_t la = strlen(da->node), lb = strlen(db->node);
+
+    /* renderD99 would sort after renderD128 otherwise */
+    if (la != lb)
+        return la < lb ? -1 : 1;
+    return strcmp(da->node, db->node);
+}
+
+int backend_scan_devices(int default_fd, struct dri_device *devices, int max)
+{
+    struct dri_device def = {};
+    struct dirent *entry;
+    struct stat st;
+    DIR *dir;
+    int n = 0;
+
+    if (default_fd >= 0 && fstat(default_fd, &st) == 0)
+        backend_device_info(st.st_rdev, &def);
+
+    dir = opendir("/dev/dri");
+    if (!dir)
+        return 0;
+
+    while (n < max && (entry = readdir(dir)))
+    {
+        struct dri_device *dev = &devices[n];
+
+        if (strncmp(entry->d_name, "renderD", 7))
+            continue;
+
+        memset(dev, 0, sizeof(*dev));
+        snprintf(dev->node, sizeof(dev->node), "/dev/dri/%s", entry->d_name);
+
+        if (stat(dev->node, &st) != 0 || !S_ISCHR(st.st_mode))
+            continue;
+        if (!backend_device_info(st.st_rdev, dev))
+        {
+            TRACE("Skipping %s, neither a PCI nor a platform device\n", dev->node);
+            continue;
+        }
+
+        dev->is_default = def.tag[0] && !strcmp(def.tag, dev->tag);
+
+        TRACE("Found %s: %s %04x:%04x%s\n", dev->node, dev->tag, dev->vendor_id,
+              dev->device_id, dev->is_default ? " (default)" : "");
+        n++;
+    }
+    closedir(dir);
+
+    /* readdir order is arbitrary, keep the order of the minor numbers */
+    qsort(devices, n, sizeof(*devices), backend_compare_devices);
+
+    return n;
+}
+
+BOOL backend_device_matches(const struct dri_device *dev, int index, const char *env)
+{
+    unsigned vendor_id, device_id;
+    char *end;
+    long l;
+
+    if (!strncmp(env, "pci-", 4) || !strncmp(env, "platform-", 9))
+        return !strcmp(env, dev->tag);
+
+    if (sscanf(env, "%x:%x", &vendor_id, &device_id) == 2 && strchr(env, ':'))
+        return dev->vendor_id == vendor_id && dev->device_id == device_id;
+
+    l = strtol(env, &end, 10);
+    if (*end == '\0')
+        return l == index;
+
+    return FALSE;
+}
+
+void backend_order_devices(struct dri_device *devices, int n, const char *prime)
+{
+    struct dri_device tmp;
+    int i;
+
+    /* the default device comes first, non-default ones follow */
+    for (i = 1; i < n; ++i)
+    {
+        if (devices[i].is_default)
+        {
+            tmp = devices[0];
+            devices[0] = devices[i];
+            devices[i] = tmp;
+            break;
+        }
+    }
+
+    if (!prime || !*prime)
+        return;
+
+    for (i = 0; i < n; ++i)
+    {
+        if (backend_device_matches(&devices[i], i, prime))
+            break;
+    }
+
+    if (i == n)
+        WARN("No device matches D3D_PRIME=%s, using the default device\n", prime);
+    else if (i != 0)
+    {
+        tmp = devices[0];
+        devices[0] = devices[i];
+        devices[i] = tmp;
+    }
+}
+
+int backend_get_devices(Display *dpy, int screen, struct dri_device **devices)
+{
+    struct dri_device *devs;
+    const char *env;
+    int i, n = 0, max = 16;
+
+    *devices = NULL;
+
+    devs = calloc(max, sizeof(*devs));
+    if (!devs)
+        return 0;
+
+    env = backend_getenv();
+
+    for (i = 0; i < backends_count; ++i)
+    {
+        if (backend_skip(i, env))
+            continue;
+
+        if (!backends[i]->probe(dpy))
+            continue;
+
+        /* the first usable backend is the one backend_create picks */
+        if (backends[i]->enumerate)
+            n = backends[i]->enumerate(dpy, screen, devs, max);
+        break;
+    }
+
+    if (n <= 0)
+    {
+        free(devs);
+        return 0;
+    }
+
+    backend_order_devices(devs, n, getenv("D3D_PRIME"));
+
+    TRACE("Primary device: %s %04x:%04x\n", devs[0].tag, devs[0].vendor_id, devs[0].device_id);
+
+    *devices = devs;
+    return n;
+}
+
+struct dri_backend *backend_create(Display *dpy, int screen, const struct dri_device *device)
 {
     struct dri_backend *dri_backend;
+    struct probed_backend claimed;
     int i;
     const char *env;
 
-    TRACE("dpy=%p screen=%d\n", dpy, screen);
+    TRACE("dpy=%p screen=%d device=%s\n", dpy, screen, device ? device->tag : "default");
 
     dri_backend = malloc(sizeof(struct dri_backend));
     if (!dri_backend)
@@ -106,18 +389,42 @@ struct dri_backend *backend_create(Display *dpy, int screen)
 
     dri_backend->funcs = NULL;
     dri_backend->priv = NULL;
+    dri_backend->inited = FALSE;
+
+    /* a default instance that doesn't match won't be used anymore */
+    claimed.priv = NULL;
+    SDL_AtomicLock(&probed_lock);
+    if (!device || device->is_default)
+    {
+        claimed = probed;
+        probed.priv = NULL;
+    }
+    SDL_AtomicUnlock(&probed_lock);
+
+    if (claimed.priv && claimed.dpy == dpy && claimed.screen == screen)
+    {
+        TRACE("Active backend: %s (probed)\n", claimed.funcs->name);
+
+        dri_backend->funcs = claimed.funcs;
+        dri_backend->priv = claimed.priv;
+        dri_backend->inited = TRUE;
+        return dri_backend;
+    }
+    backend_destroy_probed(&claimed);
 
     env = backend_getenv();
 
     for (i = 0; i < backends_count; ++i)
     {
-        if (env && strcmp(env, backends[i]->name))
+        if (backend_skip(i, env))
             continue;
 
         if (!backends[i]->probe(dpy))
             continue;
 
-        if (backends[i]->create(dpy, screen, &dri_backend->priv))
+        /* backends without enumerate only render on the default device */
+        if (backends[i]->create(dpy, screen, backends[i]->enumerate ? device : NULL,
+                                &dri_backend->priv))
         {
             TRACE("Active backend: %s\n", backends[i]->name);
 
@@ -140,7 +447,33 @@ void backend_destroy(struct dri_backend *dri_backend)
         return;
 
     if (dri_backend->priv)
+    {
+        if (dri_backend->inited)
+            dri_backend->funcs->deinit(dri_backend->priv);
         dri_backend->funcs->destroy(dri_backend->priv);
+    }
 
     free(dri_backend);
 }
+
+struct dri_backend *backend_create_selected(Display *dpy, int screen)
+{
+    struct dri_backend *dri_backend;
+    struct dri_device *devices;
+    int n;
+
+    n = backend_get_devices(dpy, screen, &devices);
+    if (!n)
+        return backend_create(dpy, screen, NULL);
+
+    dri_backend = backend_create(dpy, screen, &devices[0]);
+    if (!dri_backend && !devices[0].is_default)
+    {
+        WARN("Unable to use %s, falling back to the default device\n", devices[0].tag);
+        dri_backend = backend_create(dpy, screen, NULL);
+    }
+
+    free(devices);
+
+    return dri_backend;
+}
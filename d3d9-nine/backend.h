@@ -21,37 +21,91 @@ struct D3DWindowBuffer
 {
     PRESENTPixmapPriv *present_pixmap_priv;
     struct buffer_priv *priv; /* backend private data */
+    int width;
+    int height;
+};
+
+/* a DRM device, identified like DRI_PRIME does */
+struct dri_device
+{
+    char node[64]; /* render node, e.g. /dev/dri/renderD128 */
+    char tag[32]; /* e.g. pci-0000_01_00_0 or platform-vgem */
+    unsigned vendor_id;
+    unsigned device_id;
+    BOOL is_default; /* the device the X server renders with */
 };
 
 struct dri_backend_funcs {
     const char * const name;
+    /* the pixmap may be bigger than the buffer, which is scaled up when presented */
+    const BOOL can_scale;
 
     BOOL (*probe)(Display *dpy);
+    /* optional, lists the devices the backend can be created on */
+    int (*enumerate)(Display *dpy, int screen, struct dri_device *devices, int max);
 
-    BOOL (*create)(Display *dpy, int screen, struct dri_backend_priv **priv);
+    /* device is one enumerate listed, NULL selects the device the X server
+     * renders with and is always passed to backends without enumerate */
+    BOOL (*create)(Display *dpy, int screen, const struct dri_device *device,
+        struct dri_backend_priv **priv);
     void (*destroy)(struct dri_backend_priv *priv);
 
     BOOL (*init)(struct dri_backend_priv *priv);
     void (*deinit)(struct dri_backend_priv *priv);
     int (*get_fd)(struct dri_backend_priv *priv);
 
+    /* pixmap_width and pixmap_height equal width and height unless can_scale is set */
     BOOL (*window_buffer_from_dmabuf)(struct dri_backend_priv *priv,
         PRESENTpriv *present_priv, int fd, int width, int height,
-        int stride, int depth, int bpp, struct D3DWindowBuffer **out);
+        int stride, int depth, int bpp, int pixmap_width, int pixmap_height,
+        struct D3DWindowBuffer **out);
+    /* optional, waits until the GPU is done reading the buffer for its
+     * last present, the buffer isn't released before */
+    void (*wait_buffer_idle)(struct dri_backend_priv *priv, struct buffer_priv *buffer_priv);
     BOOL (*copy_front)(PRESENTPixmapPriv *present_pixmap_priv);
 
-    BOOL (*present_pixmap)(struct dri_backend_priv *priv, struct buffer_priv *buffer_priv);
+    /* the source rect and dirty region are those passed to PRESENTPixmap,
+     * content outside of them may be left untouched */
+    BOOL (*present_pixmap)(struct dri_backend_priv *priv, struct buffer_priv *buffer_priv,
+        const RECT *pSourceRect, const RGNDATA *pDirtyRegion);
+    /* optional, set by backends that present without X and PRESENT,
+     * the buffer is released when it returns */
+    BOOL (*present_buffer)(struct dri_backend_priv *priv, struct buffer_priv *buffer_priv,
+        UINT interval);
     void (*destroy_pixmap)(struct dri_backend_priv *priv, struct buffer_priv *buffer_priv);
 };
 
 struct dri_backend {
     const struct dri_backend_funcs *funcs;
     struct dri_backend_priv *priv; /* backend private data */
+    BOOL inited; /* holds the init reference taken while probing */
 };
 
 BOOL backend_probe(Display *dpy);
 
-struct dri_backend *backend_create(Display *dpy, int screen);
+/* D3D_BACKEND asks for a backend that doesn't need an X server */
+BOOL backend_is_headless(void);
+
+/* fills devices from the render nodes in /dev/dri, marks the one matching default_fd */
+int backend_scan_devices(int default_fd, struct dri_device *devices, int max);
+
+/* like DRI_PRIME, D3D_PRIME accepts a device index, a PCI tag or vendor:device */
+BOOL backend_device_matches(const struct dri_device *dev, int index, const char *prime);
+
+/* moves the default device to the front, then the one prime matches */
+void backend_order_devices(struct dri_device *devices, int n, const char *prime);
+
+/* devices of the active backend, the one selected by D3D_PRIME first */
+int backend_get_devices(Display *dpy, int screen, struct dri_device **devices);
+
+struct dri_backend *backend_create(Display *dpy, int screen, const struct dri_device *device);
+
+/* creates the backend on the device D3D_PRIME selects, the default one
+ * if there's no selection or it fails */
+struct dri_backend *backend_create_selected(Display *dpy, int screen);
 void backend_destroy(struct dri_backend *dri_backend);
 
+/* replaces the backends, NULL restores the built-in ones, for tests with mock backends */
+void backend_set_funcs(const struct dri_backend_funcs *const *funcs, int count);
+
 #endif /* __NINE_BACKEND_H */
@@ -9,13 +9,18 @@
  */
 
 #include <d3d9.h>
+#include <d3d9_sdl.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <SDL2/SDL.h>
 
 #include "../common/debug.h"
+#include "../common/library.h"
 #include "d3dadapter9.h"
+#include "headless.h"
 #include "shader_validator.h"
+#include "sync.h"
+#include "window.h"
 
 static int D3DPERF_event_level = 0;
 
@@ -24,10 +29,70 @@ void WINAPI DebugSetMute(void)
     /* nothing to do */
 }
 
+void WINAPI D3D9SDL_Preload(void)
+{
+    TRACE("\n");
+
+    common_preload_d3dadapter();
+}
+
+BOOL WINAPI D3D9SDL_SetPresentSyncGroup(HWND window, UINT group)
+{
+    TRACE("window %p, group %u.\n", window, group);
+
+    return sync_set_group(window, group);
+}
+
+BOOL WINAPI D3D9SDL_GetPresentSyncStats(UINT group, D3D9SDL_SYNCSTATS *stats)
+{
+    if (!stats)
+        return FALSE;
+
+    return sync_get_stats(group, stats);
+}
+
+BOOL WINAPI D3D9SDL_SetPresentTime(HWND window, UINT64 target)
+{
+    TRACE("window %p, target %llu.\n", window, (unsigned long long)target);
+
+    /* PRESENT reports UST in us */
+    return sync_set_present_time(window, target / 1000);
+}
+
+BOOL WINAPI D3D9SDL_GetPresentTimingStats(HWND window, D3D9SDL_TIMINGSTATS *stats)
+{
+    if (!stats)
+        return FALSE;
+
+    return sync_get_timing(window, stats);
+}
+
+BOOL WINAPI D3D9SDL_GetPresentFlipStats(HWND window, D3D9SDL_FLIPSTATS *stats)
+{
+    if (!stats)
+        return FALSE;
+
+    return window_get_flip_stats(window, stats);
+}
+
+BOOL WINAPI D3D9SDL_SetFrameCallback(D3D9SDL_FRAMECALLBACK callback, void *user)
+{
+    headless_set_frame_callback(callback, user);
+    return TRUE;
+}
+
+/* D3D_PRELOAD=1 starts loading the driver as soon as the application starts */
+static void NINE_ATTR_CONSTRUCTOR preload_constructor(void)
+{
+    const char *env = getenv("D3D_PRELOAD");
+
+    if (env && strtol(env, NULL, 0))
+        common_preload_d3dadapter();
+}
+
 IDirect3D9 * WINAPI Direct3DCreate9(UINT sdk_version)
 {
     IDirect3D9 *native;
-    Display* gdi_display;
     TRACE("sdk_version %#x.\n", sdk_version);
 
     if (!SDL_WasInit(SDL_INIT_VIDEO))
@@ -36,13 +101,7 @@ IDirect3D9 * WINAPI Direct3DCreate9(UINT sdk_version)
         return NULL;
     }
 
-    if (!(gdi_display = XOpenDisplay( NULL )))
-    {
-        ERR("Failed to open display.\n");
-        return NULL;
-    }
-
-    if (SUCCEEDED(d3dadapter9_new(gdi_display, FALSE, (IDirect3D9Ex **)&native)))
+    if (SUCCEEDED(d3dadapter9_new(FALSE, (IDirect3D9Ex **)&native)))
         return native;
 
     return NULL;
@@ -50,7 +109,6 @@ IDirect3D9 * WINAPI Direct3DCreate9(UINT sdk_version)
 
 HRESULT WINAPI Direct3DCreate9Ex(UINT sdk_version, IDirect3D9Ex **d3d9ex)
 {
-    Display* gdi_display;
     TRACE("sdk_version %#x, d3d9ex %p.\n", sdk_version, d3d9ex);
 
     if (!SDL_WasInit(SDL_INIT_VIDEO))
@@ -59,12 +117,7 @@ HRESULT WINAPI Direct3DCreate9Ex(UINT sdk_version, IDirect3D9Ex **d3d9ex)
         return D3DERR_INVALIDCALL;
     }
 
-    if (!(gdi_display = XOpenDisplay( NULL )))
-    {
-        ERR("Failed to open display\n");
-        return D3DERR_INVALIDDEVICE;
-    }
-    return d3dadapter9_new(gdi_display, TRUE, d3d9ex);
+    return d3dadapter9_new(TRUE, d3d9ex);
 }
 
 /*******************************************************************
@@ -11,27 +11,84 @@
  */
 
 #include <d3dadapter/d3dadapter9.h>
+#include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <SDL2/SDL.h>
 
 #include "../common/debug.h"
 #include "present.h"
 #include "backend.h"
+#include "display.h"
 
 const GUID IID_IUnknown = { 0x00000000, 0x0000, 0x0000, { 0xC0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46 } };
 const GUID IID_IDirect3D9 = { 0x81bdcbca, 0x64d4, 0x426d, { 0xae, 0x8d, 0xad, 0x1, 0x47, 0xf4, 0x27, 0x5c } };
 const GUID IID_IDirect3D9Ex = { 0x02177241, 0x69fc, 0x400c, { 0x8f, 0xf1, 0x93, 0xa4, 0x4d, 0xf6, 0x86, 0x1d } };
 
-/* this represents a snapshot taken at the moment of creation */
+/* modes of one format, sorted by size and refresh rate */
+struct mode_table
+{
+    struct mode_table *next;
+    D3DFORMAT format;
+    SDL_DisplayMode *modes;
+    unsigned nmodes;
+};
+
+/* this represents a snapshot taken at the first mode query */
 struct output
 {
+    int display; /* SDL display index */
+    BOOL enumerated;
     SDL_DisplayMode *modes;
     unsigned nmodes;
     unsigned nmodesalloc;
 
+    struct mode_table *tables;
+
     HMONITOR monitor;
 };
 
+/* Applications query format support thousands of times, the results only
+ * depend on the arguments, so they are memoized per adapter. */
+enum query_kind
+{
+    QUERY_NONE = 0,
+    QUERY_DEVICE_FORMAT,
+    QUERY_MULTISAMPLE_TYPE,
+    QUERY_DEPTH_STENCIL_MATCH
+};
+
+struct query_entry
+{
+    DWORD kind;
+    DWORD args[5];
+    HRESULT hr;
+    DWORD quality_levels;
+};
+
+struct query_caps
+{
+    BOOL valid;
+    HRESULT hr;
+    D3DCAPS9 caps;
+};
+
+struct query_cache
+{
+    SDL_mutex *mutex;
+    struct query_entry *entries; /* open addressing, power of two size */
+    unsigned nentries;
+    unsigned nentriesalloc;
+    struct query_caps caps[D3DDEVTYPE_NULLREF]; /* indexed by D3DDEVTYPE - 1 */
+    char *path; /* persistent cache file, if enabled */
+    BOOL dirty;
+};
+
 struct adapter_group
 {
     struct output *outputs;
@@ -42,6 +99,7 @@ struct adapter_group
     ID3DAdapter9 *adapter;
     /* DRI backend */
     struct dri_backend *dri_backend;
+    struct query_cache cache;
 };
 
 struct adapter_map
@@ -50,11 +108,10 @@ struct adapter_map
     unsigned master;
 };
 
-struct d3dadapter9
+/* Adapters, backends and their caches are shared by all IDirect3D9 objects */
+struct adapter_set
 {
-    /* COM vtable */
-    void *vtable;
-    /* IUnknown reference count */
+    /* protected by adapter_set_mutex */
     LONG refs;
 
     /* adapter groups and mappings */
@@ -64,25 +121,482 @@ struct d3dadapter9
     unsigned ngroups;
     unsigned ngroupsalloc;
 
+    Display *gdi_display;
+
+    /* protects the lazily built mode tables */
+    SDL_mutex *modes_mutex;
+};
+
+struct d3dadapter9
+{
+    /* COM vtable */
+    void *vtable;
+    /* IUnknown reference count */
+    LONG refs;
+
+    struct adapter_set *set;
+
     /* true if it implements IDirect3D9Ex */
     BOOL ex;
-    Display *gdi_display;
 };
 
+static pthread_mutex_t adapter_set_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct adapter_set *adapter_set;
+
 /* convenience wrapper for calls into ID3D9Adapter */
 #define ADAPTER_GROUP \
-    This->groups[This->map[Adapter].group]
+    This->set->groups[This->set->map[Adapter].group]
 
 #define ADAPTER_PROC(name, ...) \
     ID3DAdapter9_##name(ADAPTER_GROUP.adapter, ## __VA_ARGS__)
 
 #define ADAPTER_OUTPUT \
-    ADAPTER_GROUP.outputs[Adapter-This->map[Adapter].master]
+    ADAPTER_GROUP.outputs[Adapter-This->set->map[Adapter].master]
 
 static HRESULT WINAPI d3dadapter9_CheckDeviceFormat(struct d3dadapter9 *This,
         UINT Adapter, D3DDEVTYPE DeviceType, D3DFORMAT AdapterFormat,
         DWORD Usage, D3DRESOURCETYPE RType, D3DFORMAT CheckFormat);
 
+static void free_output(struct output *out)
+{
+    struct mode_table *table, *next;
+
+    for (table = out->tables; table; table = next)
+    {
+        next = table->next;
+        free(table->modes);
+        free(table);
+    }
+    free(out->modes);
+}
+
+static SDL_DisplayMode *add_mode(struct output *out)
+{
+    if (out->nmodes >= out->nmodesalloc)
+    {
+        void *r;
+
+        if (out->nmodesalloc == 0)
+        {
+            out->nmodesalloc = 8;
+            r = calloc(out->nmodesalloc, sizeof(SDL_DisplayMode));
+        }
+        else
+        {
+            out->nmodesalloc <<= 1;
+            r = realloc(out->modes, out->nmodesalloc*sizeof(SDL_DisplayMode));
+        }
+
+        if (!r)
+            return NULL;
+        out->modes = r;
+    }
+
+    return &out->modes[out->nmodes++];
+}
+
+static void remove_mode(struct output *out)
+{
+    out->nmodes--;
+}
+
+/* must be called with modes_mutex held */
+static void enumerate_modes(struct output *out)
+{
+    int k, n;
+
+    if (out->enumerated)
+        return;
+    out->enumerated = TRUE;
+
+    n = SDL_GetNumDisplayModes(out->display);
+    for (k = 0; k < n; ++k)
+    {
+        SDL_DisplayMode *mode = add_mode(out);
+        if (!mode)
+        {
+            ERR("Out of memory.\n");
+            return;
+        }
+
+        if (SDL_GetDisplayMode(out->display, k, mode) < 0)
+        {
+            WARN("Unable to get display mode for display %d, mode %d.\n", out->display, k);
+            remove_mode(out);
+            continue;
+        }
+
+        TRACE("format=%s, w=%d, h=%d, refresh_rate=%d\n",
+                SDL_GetPixelFormatName(mode->format), mode->w, mode->h, mode->refresh_rate);
+    }
+}
+
+static int compare_modes(const void *a, const void *b)
+{
+    const SDL_DisplayMode *ma = a, *mb = b;
+
+    if (ma->w != mb->w)
+        return ma->w - mb->w;
+    if (ma->h != mb->h)
+        return ma->h - mb->h;
+    return ma->refresh_rate - mb->refresh_rate;
+}
+
+/* Returns the modes of the output for a format, built on first use.
+ * Formats the display doesn't expose natively, e.g. 16 bit formats on
+ * a 24 bit desktop, get all modes. Tables stay valid until release. */
+static const struct mode_table *get_mode_table(struct d3dadapter9 *This,
+        struct output *out, D3DFORMAT format)
+{
+    struct mode_table *table;
+    unsigned i, n, nmatch = 0;
+
+    SDL_LockMutex(This->set->modes_mutex);
+
+    for (table = out->tables; table; table = table->next)
+    {
+        if (table->format == format)
+        {
+            SDL_UnlockMutex(This->set->modes_mutex);
+            return table;
+        }
+    }
+
+    enumerate_modes(out);
+
+    table = calloc(1, sizeof(struct mode_table));
+    if (table && out->nmodes)
+        table->modes = calloc(out->nmodes, sizeof(SDL_DisplayMode));
+    if (!table || (out->nmodes && !table->modes))
+    {
+        ERR("Out of memory.\n");
+        free(table);
+        SDL_UnlockMutex(This->set->modes_mutex);
+        return NULL;
+    }
+
+    for (i = 0; i < out->nmodes; ++i)
+    {
+        if (to_d3d_format(out->modes[i].format) == format)
+            nmatch++;
+    }
+
+    for (i = n = 0; i < out->nmodes; ++i)
+    {
+        if (!nmatch || to_d3d_format(out->modes[i].format) == format)
+            table->modes[n++] = out->modes[i];
+    }
+
+    qsort(table->modes, n, sizeof(SDL_DisplayMode), compare_modes);
+
+    /* drop modes only differing in a format the table doesn't distinguish */
+    for (i = 0; i < n; ++i)
+    {
+        if (table->nmodes && !compare_modes(&table->modes[table->nmodes - 1], &table->modes[i]))
+            continue;
+        table->modes[table->nmodes++] = table->modes[i];
+    }
+
+    table->format = format;
+    table->next = out->tables;
+    out->tables = table;
+
+    TRACE("%u modes for format %#x on display %d.\n", table->nmodes, format, out->display);
+
+    SDL_UnlockMutex(This->set->modes_mutex);
+    return table;
+}
+
+#define QUERY_CACHE_MAGIC 0x4351394e /* "N9QC" */
+#define QUERY_CACHE_VERSION 1
+
+struct query_cache_header
+{
+    DWORD magic;
+    DWORD version;
+    DWORD entry_size;
+    DWORD caps_size;
+    DWORD nentries;
+};
+
+static unsigned query_hash(const struct query_entry *key)
+{
+    unsigned h = 2166136261u, i;
+
+    h = (h ^ key->kind) * 16777619u;
+    for (i = 0; i < 5; ++i)
+        h = (h ^ key->args[i]) * 16777619u;
+    return h;
+}
+
+/* must be called with the cache mutex held */
+static struct query_entry *query_cache_find(struct query_cache *cache,
+        const struct query_entry *key)
+{
+    unsigned mask = cache->nentriesalloc - 1, i;
+
+    if (!cache->entries)
+        return NULL;
+
+    for (i = query_hash(key) & mask; cache->entries[i].kind; i = (i + 1) & mask)
+    {
+        if (cache->entries[i].kind == key->kind &&
+                !memcmp(cache->entries[i].args, key->args, sizeof(key->args)))
+            return &cache->entries[i];
+    }
+    return NULL;
+}
+
+/* must be called with the cache mutex held */
+static void query_cache_insert(struct query_cache *cache, const struct query_entry *entry)
+{
+    unsigned mask, i;
+
+    /* keep the load factor below 1/2 */
+    if ((cache->nentries + 1) * 2 > cache->nentriesalloc)
+    {
+        struct query_entry *old = cache->entries;
+        unsigned nold = cache->nentriesalloc;
+        unsigned nalloc = nold ? nold << 1 : 256;
+        struct query_entry *r = calloc(nalloc, sizeof(struct query_entry));
+
+        if (!r)
+            return;
+
+        cache->entries = r;
+        cache->nentriesalloc = nalloc;
+        cache->nentries = 0;
+        for (i = 0; i < nold; ++i)
+        {
+            if (old[i].kind)
+                query_cache_insert(cache, &old[i]);
+        }
+        free(old);
+    }
+
+    mask = cache->nentriesalloc - 1;
+    for (i = query_hash(entry) & mask; cache->entries[i].kind; i = (i + 1) & mask)
+        ;
+    cache->entries[i] = *entry;
+    cache->nentries++;
+}
+
+static void query_cache_load(struct query_cache *cache)
+{
+    struct query_cache_header header;
+    struct query_entry entry;
+    FILE *f;
+    unsigned i;
+
+    f = fopen(cache->path, "rb");
+    if (!f)
+        return;
+
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+            header.magic != QUERY_CACHE_MAGIC ||
+            header.version != QUERY_CACHE_VERSION ||
+            header.entry_size != sizeof(struct query_entry) ||
+            header.caps_size != sizeof(cache->caps))
+    {
+        WARN("Ignoring invalid query cache %s\n", cache->path);
+        fclose(f);
+        return;
+    }
+
+    if (fread(cache->caps, sizeof(cache->caps), 1, f) != 1)
+        ZeroMemory(cache->caps, sizeof(cache->caps));
+
+    for (i = 0; i < header.nentries && fread(&entry, sizeof(entry), 1, f) == 1; ++i)
+    {
+        if (entry.kind != QUERY_NONE && !query_cache_find(cache, &entry))
+            query_cache_insert(cache, &entry);
+    }
+    fclose(f);
+
+    TRACE("Loaded %u queries from %s\n", cache->nentries, cache->path);
+}
+
+static void query_cache_save(struct query_cache *cache)
+{
+    struct query_cache_header header;
+    char tmp[PATH_MAX];
+    FILE *f;
+    unsigned i;
+
+    if (!cache->path || !cache->dirty)
+        return;
+
+    /* write to a temporary file, so concurrent instances never read a partial cache */
+    snprintf(tmp, sizeof(tmp), "%s.%d", cache->path, (int)getpid());
+
+    f = fopen(tmp, "wb");
+    if (!f)
+        return;
+
+    header.magic = QUERY_CACHE_MAGIC;
+    header.version = QUERY_CACHE_VERSION;
+    header.entry_size = sizeof(struct query_entry);
+    header.caps_size = sizeof(cache->caps);
+    header.nentries = cache->nentries;
+
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(cache->caps, sizeof(cache->caps), 1, f);
+    for (i = 0; i < cache->nentriesalloc; ++i)
+    {
+        if (cache->entries[i].kind)
+            fwrite(&cache->entries[i], sizeof(struct query_entry), 1, f);
+    }
+
+    if (fclose(f) == 0)
+        rename(tmp, cache->path);
+    else
+        unlink(tmp);
+}
+
+/* The persistent cache is keyed on the driver identifier and version,
+ * a driver update starts a new file. */
+static void query_cache_init(struct query_cache *cache, ID3DAdapter9 *adapter)
+{
+    D3DADAPTER_IDENTIFIER9 id;
+    const char *env = getenv("D3D_QUERY_CACHE");
+    const char *home;
+    char dir[PATH_MAX], path[PATH_MAX];
+    unsigned h = 2166136261u;
+    const unsigned char *p;
+
+    cache->mutex = SDL_CreateMutex();
+
+    if (!env || !strtol(env, NULL, 0))
+        return;
+
+    ZeroMemory(&id, sizeof(id));
+    if (FAILED(ID3DAdapter9_GetAdapterIdentifier(adapter, 0, &id)))
+        return;
+
+    for (p = (const unsigned char *)id.Driver; *p; ++p)
+        h = (h ^ *p) * 16777619u;
+    for (p = (const unsigned char *)id.Description; *p; ++p)
+        h = (h ^ *p) * 16777619u;
+    for (p = (const unsigned char *)&id.DeviceIdentifier;
+            p < (const unsigned char *)(&id.DeviceIdentifier + 1); ++p)
+        h = (h ^ *p) * 16777619u;
+
+    if ((home = getenv("XDG_CACHE_HOME")) && *home)
+        snprintf(dir, sizeof(dir), "%s/sdl-nine", home);
+    else if ((home = getenv("HOME")))
+    {
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+        mkdir(dir, 0755);
+        snprintf(dir, sizeof(dir), "%s/.cache/sdl-nine", home);
+    }
+    else
+        return;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    {
+        WARN("Failed to create query cache directory %s\n", dir);
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s/%04x-%04x-%08x%08x-%08x.bin", dir,
+            id.VendorId, id.DeviceId, id.DriverVersionHighPart,
+            id.DriverVersionLowPart, h);
+    cache->path = strdup(path);
+
+    if (cache->path)
+        query_cache_load(cache);
+}
+
+static void query_cache_destroy(struct query_cache *cache)
+{
+    if (cache->mutex)
+    {
+        query_cache_save(cache);
+        SDL_DestroyMutex(cache->mutex);
+    }
+    free(cache->entries);
+    free(cache->path);
+    ZeroMemory(cache, sizeof(*cache));
+}
+
+/* returns TRUE with hr and quality_levels filled in if the query was seen before */
+static BOOL query_cache_get(struct query_cache *cache, struct query_entry *key)
+{
+    const struct query_entry *entry;
+
+    SDL_LockMutex(cache->mutex);
+    entry = query_cache_find(cache, key);
+    if (entry)
+    {
+        key->hr = entry->hr;
+        key->quality_levels = entry->quality_levels;
+    }
+    SDL_UnlockMutex(cache->mutex);
+
+    return entry != NULL;
+}
+
+static void query_cache_put(struct query_cache *cache, const struct query_entry *entry)
+{
+    SDL_LockMutex(cache->mutex);
+    if (!query_cache_find(cache, entry))
+    {
+        query_cache_insert(cache, entry);
+        cache->dirty = TRUE;
+    }
+    SDL_UnlockMutex(cache->mutex);
+}
+
+static void adapter_set_destroy(struct adapter_set *set)
+{
+    if (set->map)
+    {
+        free(set->map);
+    }
+
+    if (set->groups)
+    {
+        int i, j;
+        for (i = 0; i < set->ngroups; ++i)
+        {
+            if (set->groups[i].outputs)
+            {
+                for (j = 0; j < set->groups[i].noutputs; ++j)
+                    free_output(&set->groups[i].outputs[j]);
+                free(set->groups[i].outputs);
+            }
+
+            if (set->groups[i].adapter)
+                ID3DAdapter9_Release(set->groups[i].adapter);
+
+            query_cache_destroy(&set->groups[i].cache);
+            backend_destroy(set->groups[i].dri_backend);
+        }
+        free(set->groups);
+    }
+
+    SDL_DestroyMutex(set->modes_mutex);
+    if (set->gdi_display)
+        XCloseDisplay(set->gdi_display);
+    free(set);
+}
+
+static void adapter_set_release(struct adapter_set *set)
+{
+    if (!set)
+        return;
+
+    pthread_mutex_lock(&adapter_set_mutex);
+    if (--set->refs == 0)
+    {
+        TRACE("Destroying adapter set %p.\n", set);
+        if (adapter_set == set)
+            adapter_set = NULL;
+        adapter_set_destroy(set);
+    }
+    pthread_mutex_unlock(&adapter_set_mutex);
+}
+
 static ULONG WINAPI d3dadapter9_AddRef(struct d3dadapter9 *This)
 {
     ULONG refs = InterlockedIncrement(&This->refs);
@@ -97,36 +611,7 @@ static ULONG WINAPI d3dadapter9_Release(struct d3dadapter9 *This)
     if (refs == 0)
     {
         /* dtor */
-        if (This->map)
-        {
-            free(This->map);
-        }
-
-        if (This->groups)
-        {
-            int i, j;
-            for (i = 0; i < This->ngroups; ++i)
-            {
-                if (This->groups[i].outputs)
-                {
-                    for (j = 0; j < This->groups[i].noutputs; ++j)
-                    {
-                        if (This->groups[i].outputs[j].modes)
-                        {
-                            free(This->groups[i].outputs[j].modes);
-                        }
-                    }
-                    free(This->groups[i].outputs);
-                }
-
-                if (This->groups[i].adapter)
-                    ID3DAdapter9_Release(This->groups[i].adapter);
-
-                backend_destroy(This->groups[i].dri_backend);
-            }
-            free(This->groups);
-        }
-
+        adapter_set_release(This->set);
         free(This);
     }
     return refs;
@@ -162,7 +647,7 @@ static HRESULT WINAPI d3dadapter9_RegisterSoftwareDevice(struct d3dadapter9 *Thi
 
 static UINT WINAPI d3dadapter9_GetAdapterCount(struct d3dadapter9 *This)
 {
-    return This->nadapters;
+    return This->set->nadapters;
 }
 
 static HRESULT WINAPI d3dadapter9_GetAdapterIdentifier(struct d3dadapter9 *This,
@@ -177,6 +662,8 @@ static HRESULT WINAPI d3dadapter9_GetAdapterIdentifier(struct d3dadapter9 *This,
 static UINT WINAPI d3dadapter9_GetAdapterModeCount(struct d3dadapter9 *This,
         UINT Adapter, D3DFORMAT Format)
 {
+    const struct mode_table *table;
+
     if (Adapter >= d3dadapter9_GetAdapterCount(This))
         return D3DERR_INVALIDCALL;
 
@@ -187,13 +674,18 @@ static UINT WINAPI d3dadapter9_GetAdapterModeCount(struct d3dadapter9 *This,
         return 0;
     }
 
-    TRACE("%u modes.\n", ADAPTER_OUTPUT.nmodes);
-    return ADAPTER_OUTPUT.nmodes;
+    table = get_mode_table(This, &ADAPTER_OUTPUT, Format);
+    if (!table)
+        return 0;
+
+    TRACE("%u modes.\n", table->nmodes);
+    return table->nmodes;
 }
 
 static HRESULT WINAPI d3dadapter9_EnumAdapterModes(struct d3dadapter9 *This,
         UINT Adapter, D3DFORMAT Format, UINT Mode, D3DDISPLAYMODE *pMode)
 {
+    const struct mode_table *table;
     HRESULT hr;
 
     if (Adapter >= d3dadapter9_GetAdapterCount(This))
@@ -208,15 +700,16 @@ static HRESULT WINAPI d3dadapter9_EnumAdapterModes(struct d3dadapter9 *This,
         return hr;
     }
 
-    if (Mode >= ADAPTER_OUTPUT.nmodes)
+    table = get_mode_table(This, &ADAPTER_OUTPUT, Format);
+    if (!table || Mode >= table->nmodes)
     {
         WARN("Mode %u does not exist.\n", Mode);
         return D3DERR_INVALIDCALL;
     }
 
-    pMode->Width = ADAPTER_OUTPUT.modes[Mode].w;
-    pMode->Height = ADAPTER_OUTPUT.modes[Mode].h;
-    pMode->RefreshRate = ADAPTER_OUTPUT.modes[Mode].refresh_rate;
+    pMode->Width = table->modes[Mode].w;
+    pMode->Height = table->modes[Mode].h;
+    pMode->RefreshRate = table->modes[Mode].refresh_rate;
     pMode->Format = Format;
 
     return D3D_OK;
@@ -231,7 +724,7 @@ static HRESULT WINAPI d3dadapter9_GetAdapterDisplayMode(struct d3dadapter9 *This
         return D3DERR_INVALIDCALL;
 
     ZeroMemory(&Mode, sizeof(Mode));
-    if (SDL_GetCurrentDisplayMode(Adapter, &Mode) < 0)
+    if (!display_get_current_mode(ADAPTER_OUTPUT.display, &Mode))
         return D3DERR_INVALIDCALL;
 
     pMode->Width = Mode.w;
@@ -257,33 +750,63 @@ static HRESULT WINAPI d3dadapter9_CheckDeviceFormat(struct d3dadapter9 *This,
         UINT Adapter, D3DDEVTYPE DeviceType, D3DFORMAT AdapterFormat,
         DWORD Usage, D3DRESOURCETYPE RType, D3DFORMAT CheckFormat)
 {
+    struct query_entry query = { QUERY_DEVICE_FORMAT,
+            { DeviceType, AdapterFormat, Usage, RType, CheckFormat } };
+
     if (Adapter >= d3dadapter9_GetAdapterCount(This))
         return D3DERR_INVALIDCALL;
 
-    return ADAPTER_PROC(CheckDeviceFormat,
+    if (query_cache_get(&ADAPTER_GROUP.cache, &query))
+        return query.hr;
+
+    query.hr = ADAPTER_PROC(CheckDeviceFormat,
              DeviceType, AdapterFormat, Usage, RType, CheckFormat);
+    query_cache_put(&ADAPTER_GROUP.cache, &query);
+
+    return query.hr;
 }
 
 static HRESULT WINAPI d3dadapter9_CheckDeviceMultiSampleType(struct d3dadapter9 *This,
         UINT Adapter, D3DDEVTYPE DeviceType, D3DFORMAT SurfaceFormat,
         BOOL Windowed, D3DMULTISAMPLE_TYPE MultiSampleType, DWORD *pQualityLevels)
 {
+    struct query_entry query = { QUERY_MULTISAMPLE_TYPE,
+            { DeviceType, SurfaceFormat, Windowed, MultiSampleType } };
+
     if (Adapter >= d3dadapter9_GetAdapterCount(This))
         return D3DERR_INVALIDCALL;
 
-    return ADAPTER_PROC(CheckDeviceMultiSampleType, DeviceType, SurfaceFormat,
-            Windowed, MultiSampleType, pQualityLevels);
+    if (!query_cache_get(&ADAPTER_GROUP.cache, &query))
+    {
+        query.hr = ADAPTER_PROC(CheckDeviceMultiSampleType, DeviceType, SurfaceFormat,
+                Windowed, MultiSampleType, &query.quality_levels);
+        query_cache_put(&ADAPTER_GROUP.cache, &query);
+    }
+
+    if (pQualityLevels && SUCCEEDED(query.hr))
+        *pQualityLevels = query.quality_levels;
+
+    return query.hr;
 }
 
 static HRESULT WINAPI d3dadapter9_CheckDepthStencilMatch(struct d3dadapter9 *This,
         UINT Adapter, D3DDEVTYPE DeviceType, D3DFORMAT AdapterFormat,
         D3DFORMAT RenderTargetFormat, D3DFORMAT DepthStencilFormat)
 {
+    struct query_entry query = { QUERY_DEPTH_STENCIL_MATCH,
+            { DeviceType, AdapterFormat, RenderTargetFormat, DepthStencilFormat } };
+
     if (Adapter >= d3dadapter9_GetAdapterCount(This))
         return D3DERR_INVALIDCALL;
 
-    return ADAPTER_PROC(CheckDepthStencilMatch, DeviceType, AdapterFormat,
+    if (query_cache_get(&ADAPTER_GROUP.cache, &query))
+        return query.hr;
+
+    query.hr = ADAPTER_PROC(CheckDepthStencilMatch, DeviceType, AdapterFormat,
             RenderTargetFormat, DepthStencilFormat);
+    query_cache_put(&ADAPTER_GROUP.cache, &query);
+
+    return query.hr;
 }
 
 static HRESULT WINAPI d3dadapter9_CheckDeviceFormatConversion(struct d3dadapter9 *This,
@@ -299,17 +822,49 @@ static HRESULT WINAPI d3dadapter9_CheckDeviceFormatConversion(struct d3dadapter9
 static HRESULT WINAPI d3dadapter9_GetDeviceCaps(struct d3dadapter9 *This,
         UINT Adapter, D3DDEVTYPE DeviceType, D3DCAPS9 *pCaps)
 {
+    struct query_cache *cache;
+    struct query_caps *caps = NULL;
     HRESULT hr;
 
     if (Adapter >= d3dadapter9_GetAdapterCount(This))
         return D3DERR_INVALIDCALL;
 
-    hr = ADAPTER_PROC(GetDeviceCaps, DeviceType, pCaps);
+    if (!pCaps)
+        return D3DERR_INVALIDCALL;
+
+    cache = &ADAPTER_GROUP.cache;
+    if (DeviceType >= D3DDEVTYPE_HAL && DeviceType <= D3DDEVTYPE_NULLREF)
+        caps = &cache->caps[DeviceType - D3DDEVTYPE_HAL];
+
+    SDL_LockMutex(cache->mutex);
+    if (caps && caps->valid)
+    {
+        hr = caps->hr;
+        *pCaps = caps->caps;
+        SDL_UnlockMutex(cache->mutex);
+    }
+    else
+    {
+        SDL_UnlockMutex(cache->mutex);
+
+        hr = ADAPTER_PROC(GetDeviceCaps, DeviceType, pCaps);
+
+        if (caps)
+        {
+            SDL_LockMutex(cache->mutex);
+            caps->valid = TRUE;
+            caps->hr = hr;
+            if (SUCCEEDED(hr))
+                caps->caps = *pCaps;
+            cache->dirty = TRUE;
+            SDL_UnlockMutex(cache->mutex);
+        }
+    }
     if (FAILED(hr))
         return hr;
 
-    pCaps->MasterAdapterOrdinal = This->map[Adapter].master;
-    pCaps->AdapterOrdinalInGroup = Adapter-This->map[Adapter].master;
+    pCaps->MasterAdapterOrdinal = This->set->map[Adapter].master;
+    pCaps->AdapterOrdinalInGroup = Adapter-This->set->map[Adapter].master;
     pCaps->NumberOfAdaptersInGroup = ADAPTER_GROUP.noutputs;
 
     return hr;
@@ -346,7 +901,13 @@ static HRESULT WINAPI d3dadapter9_CreateDevice(struct d3dadapter9 *This,
 static UINT WINAPI d3dadapter9_GetAdapterModeCountEx(struct d3dadapter9 *This,
         UINT Adapter, const D3DDISPLAYMODEFILTER *pFilter)
 {
-    FIXME("(%p, %u, %p), half stub!\n", This, Adapter, pFilter);
+    if (Adapter >= d3dadapter9_GetAdapterCount(This) || !pFilter)
+        return 0;
+
+    /* all modes are progressive */
+    if (pFilter->ScanLineOrdering == D3DSCANLINEORDERING_INTERLACED)
+        return 0;
+
     return d3dadapter9_GetAdapterModeCount(This, Adapter, pFilter->Format);
 }
 
@@ -354,33 +915,27 @@ static HRESULT WINAPI d3dadapter9_EnumAdapterModesEx(struct d3dadapter9 *This,
         UINT Adapter, const D3DDISPLAYMODEFILTER *pFilter, UINT Mode,
         D3DDISPLAYMODEEX *pMode)
 {
+    D3DDISPLAYMODE mode;
     HRESULT hr;
 
-    FIXME("(%p, %u, %p, %u, %p), half stub!\n", This, Adapter, pFilter, Mode, pMode);
-
-    if (Adapter >= d3dadapter9_GetAdapterCount(This))
+    if (Adapter >= d3dadapter9_GetAdapterCount(This) || !pFilter || !pMode)
         return D3DERR_INVALIDCALL;
 
-    hr = d3dadapter9_CheckDeviceFormat(This, Adapter, D3DDEVTYPE_HAL,
-            pFilter->Format, D3DUSAGE_RENDERTARGET, D3DRTYPE_SURFACE, pFilter->Format);
-
-    if (FAILED(hr))
-    {
-        TRACE("DeviceFormat not available.\n");
-        return hr;
-    }
-
-    if (Mode >= ADAPTER_OUTPUT.nmodes)
+    if (pFilter->ScanLineOrdering == D3DSCANLINEORDERING_INTERLACED)
     {
         WARN("Mode %u does not exist.\n", Mode);
         return D3DERR_INVALIDCALL;
     }
 
+    hr = d3dadapter9_EnumAdapterModes(This, Adapter, pFilter->Format, Mode, &mode);
+    if (FAILED(hr))
+        return hr;
+
     pMode->Size = sizeof(D3DDISPLAYMODEEX);
-    pMode->Width = ADAPTER_OUTPUT.modes[Mode].w;
-    pMode->Height = ADAPTER_OUTPUT.modes[Mode].h;
-    pMode->RefreshRate = ADAPTER_OUTPUT.modes[Mode].refresh_rate;
-    pMode->Format = to_d3d_format(ADAPTER_OUTPUT.modes[Mode].format);
+    pMode->Width = mode.Width;
+    pMode->Height = mode.Height;
+    pMode->RefreshRate = mode.RefreshRate;
+    pMode->Format = mode.Format;
     pMode->ScanLineOrdering = D3DSCANLINEORDERING_PROGRESSIVE;
 
     return D3D_OK;
@@ -397,7 +952,7 @@ static HRESULT WINAPI d3dadapter9_GetAdapterDisplayModeEx(struct d3dadapter9 *Th
     if (pMode)
     {
         ZeroMemory(&Mode, sizeof(Mode));
-        if (SDL_GetCurrentDisplayMode(Adapter, &Mode) < 0)
+        if (!display_get_current_mode(ADAPTER_OUTPUT.display, &Mode))
             return D3DERR_INVALIDCALL;
 
         pMode->Size = sizeof(D3DDISPLAYMODEEX);
@@ -427,16 +982,30 @@ static HRESULT WINAPI d3dadapter9_CreateDeviceEx(struct d3dadapter9 *This,
 
     {
         struct adapter_group *group = &ADAPTER_GROUP;
-        unsigned nparams;
+        unsigned nparams, i;
+        int *displays;
 
         if (BehaviorFlags & D3DCREATE_ADAPTERGROUP_DEVICE)
             nparams = group->noutputs;
         else
             nparams = 1;
 
-        hr = present_create_present_group(This->gdi_display, hFocusWindow,
-                pPresentationParameters, pFullscreenDisplayMode, nparams,
+        /* the SDL display of each head */
+        displays = calloc(nparams, sizeof(int));
+        if (!displays)
+            return E_OUTOFMEMORY;
+        if (nparams == 1)
+            displays[0] = ADAPTER_OUTPUT.display;
+        else
+        {
+            for (i = 0; i < nparams; ++i)
+                displays[i] = group->outputs[i].display;
+        }
+
+        hr = present_create_present_group(This->set->gdi_display, hFocusWindow,
+                pPresentationParameters, pFullscreenDisplayMode, displays, nparams,
                 &present, This->ex, BehaviorFlags, group->dri_backend);
+        free(displays);
     }
 
     if (FAILED(hr))
@@ -475,51 +1044,50 @@ static HRESULT WINAPI d3dadapter9_GetAdapterLUID(struct d3dadapter9 *This,
     return D3DERR_INVALIDCALL;
 }
 
-static struct adapter_group *add_group(struct d3dadapter9 *This)
+static struct adapter_group *add_group(struct adapter_set *set)
 {
-    if (This->ngroups >= This->ngroupsalloc)
+    if (set->ngroups >= set->ngroupsalloc)
     {
         void *r;
 
-        if (This->ngroupsalloc == 0)
+        if (set->ngroupsalloc == 0)
         {
-            This->ngroupsalloc = 2;
-            r = calloc(This->ngroupsalloc, sizeof(struct adapter_group));
+            set->ngroupsalloc = 2;
+            r = calloc(set->ngroupsalloc, sizeof(struct adapter_group));
         }
         else
         {
-            This->ngroupsalloc <<= 1;
-            r = realloc(This->groups, This->ngroupsalloc*sizeof(struct adapter_group));
+            set->ngroupsalloc <<= 1;
+            r = realloc(set->groups, set->ngroupsalloc*sizeof(struct adapter_group));
         }
 
         if (!r)
             return NULL;
-        This->groups = r;
+        set->groups = r;
     }
 
-    return &This->groups[This->ngroups++];
+    return &set->groups[set->ngroups++];
 }
 
-static void remove_group(struct d3dadapter9 *This)
+static void remove_group(struct adapter_set *set)
 {
-    struct adapter_group *group = &This->groups[This->ngroups-1];
+    struct adapter_group *group = &set->groups[set->ngroups-1];
     int i;
 
     for (i = 0; i < group->noutputs; ++i)
-    {
-        free(group->outputs[i].modes);
-    }
+        free_output(&group->outputs[i]);
     free(group->outputs);
 
+    query_cache_destroy(&group->cache);
     backend_destroy(group->dri_backend);
 
     ZeroMemory(group, sizeof(struct adapter_group));
-    This->ngroups--;
+    set->ngroups--;
 }
 
-static struct output *add_output(struct d3dadapter9 *This)
+static struct output *add_output(struct adapter_set *set)
 {
-    struct adapter_group *group = &This->groups[This->ngroups-1];
+    struct adapter_group *group = &set->groups[set->ngroups-1];
 
     if (group->noutputs >= group->noutputsalloc)
     {
@@ -544,109 +1112,50 @@ static struct output *add_output(struct d3dadapter9 *This)
     return &group->outputs[group->noutputs++];
 }
 
-static void remove_output(struct d3dadapter9 *This)
-{
-    struct adapter_group *group = &This->groups[This->ngroups-1];
-    struct output *out = &group->outputs[group->noutputs-1];
-
-    free(out->modes);
-
-    ZeroMemory(out, sizeof(struct output));
-    group->noutputs--;
-}
-
-static SDL_DisplayMode *add_mode(struct d3dadapter9 *This)
+static HRESULT fill_groups(struct adapter_set *set)
 {
-    struct adapter_group *group = &This->groups[This->ngroups-1];
-    struct output *out = &group->outputs[group->noutputs-1];
+    struct adapter_group *group;
+    int screen = set->gdi_display ? DefaultScreen(set->gdi_display) : 0;
+    HRESULT hr;
+    int j;
 
-    if (out->nmodes >= out->nmodesalloc)
+    /* The X server composes all outputs, so every display belongs to one
+     * group on the device D3D_PRIME selects or the default one. */
+    group = add_group(set);
+    if (!group)
     {
-        void *r;
-
-        if (out->nmodesalloc == 0)
-        {
-            out->nmodesalloc = 8;
-            r = calloc(out->nmodesalloc, sizeof(struct D3DDISPLAYMODEEX));
-        }
-        else
-        {
-            out->nmodesalloc <<= 1;
-            r = realloc(out->modes, out->nmodesalloc*sizeof(struct D3DDISPLAYMODEEX));
-        }
-
-        if (!r)
-            return NULL;
-        out->modes = r;
+        ERR("Out of memory.\n");
+        return E_OUTOFMEMORY;
     }
 
-    return &out->modes[out->nmodes++];
-}
+    group->dri_backend = backend_create_selected(set->gdi_display, screen);
+    if (!group->dri_backend)
+    {
+        ERR("Unable to open backend for screen %d.\n", screen);
+        remove_group(set);
+        return D3D_OK;
+    }
 
-static void remove_mode(struct d3dadapter9 *This)
-{
-    struct adapter_group *group = &This->groups[This->ngroups-1];
-    struct output *out = &group->outputs[group->noutputs-1];
-    out->nmodes--;
-}
+    hr = present_create_adapter9(group->dri_backend, &group->adapter);
+    if (FAILED(hr))
+    {
+        remove_group(set);
+        return D3D_OK;
+    }
 
-static HRESULT fill_groups(struct d3dadapter9 *This)
-{
-    HRESULT hr;
-    int i, j, k;
+    query_cache_init(&group->cache, group->adapter);
 
-    // TODO: Multiple adapters
-    for (i = 0; i < 1; ++i)
+    for (j = 0; j < SDL_GetNumVideoDisplays(); ++j)
     {
-        struct adapter_group *group = add_group(This);
-        if (!group)
+        struct output *out = add_output(set);
+        if (!out)
         {
             ERR("Out of memory.\n");
             return E_OUTOFMEMORY;
         }
 
-        group->dri_backend = backend_create(This->gdi_display, DefaultScreen(This->gdi_display));
-        if (!group->dri_backend)
-        {
-            ERR("Unable to open backend for display %d.\n", i);
-            continue;
-        }
-
-        hr = present_create_adapter9(group->dri_backend, &group->adapter);
-        if (FAILED(hr))
-        {
-            remove_group(This);
-            continue;
-        }
-
-        for (j = 0; j < SDL_GetNumVideoDisplays(); ++j)
-        {
-            struct output *out = add_output(This);
-            if (!out)
-            {
-                ERR("Out of memory.\n");
-                return E_OUTOFMEMORY;
-            }
-
-            for (k = 0; k < SDL_GetNumDisplayModes(j); ++k)
-            {
-                SDL_DisplayMode *mode = add_mode(This);
-                if (!out)
-                {
-                    ERR("Out of memory.\n");
-                    return E_OUTOFMEMORY;
-                }
-
-                if (SDL_GetDisplayMode(j, k, mode) < 0)
-                {
-                    remove_output(This);
-                    WARN("Unable to get display mode for display %d, mode %d.\n", j, k);
-                }
-
-                TRACE("format=%s, w=%d, h=%d, refresh_rate=%d\n",
-                        SDL_GetPixelFormatName(mode->format), mode->w, mode->h, mode->refresh_rate);
-            }
-        }
+        /* modes are enumerated on first query */
+        out->display = j;
     }
 
     return D3D_OK;
@@ -677,69 +1186,120 @@ static IDirect3D9ExVtbl d3dadapter9_vtable = {
     (void *)d3dadapter9_GetAdapterLUID
 };
 
-HRESULT d3dadapter9_new(Display *gdi_display, BOOL ex, IDirect3D9Ex **ppOut)
+static HRESULT adapter_set_create(struct adapter_set **out)
 {
-    struct d3dadapter9 *This;
+    struct adapter_set *set;
     HRESULT hr;
     unsigned i, j, k;
 
-    This = calloc(1, sizeof(struct d3dadapter9));
-    if (!This)
+    set = calloc(1, sizeof(struct adapter_set));
+    if (!set)
     {
         ERR("Out of memory.\n");
         return E_OUTOFMEMORY;
     }
 
-    This->vtable = &d3dadapter9_vtable;
-    This->refs = 1;
-    This->ex = ex;
-    This->gdi_display = gdi_display;
+    set->refs = 1;
+    set->modes_mutex = SDL_CreateMutex();
 
-    if (!present_has_d3dadapter(gdi_display))
+    /* the headless backend doesn't need an X server */
+    if (!(set->gdi_display = XOpenDisplay(NULL)) && !backend_is_headless())
+    {
+        ERR("Failed to open display.\n");
+        adapter_set_destroy(set);
+        return D3DERR_INVALIDDEVICE;
+    }
+
+    if (!present_has_d3dadapter(set->gdi_display))
     {
         ERR("Your display driver doesn't support native D3D9 adapters.\n");
-        d3dadapter9_Release(This);
+        adapter_set_destroy(set);
         return D3DERR_NOTAVAILABLE;
     }
 
-    if (FAILED(hr = fill_groups(This)))
+    if (FAILED(hr = fill_groups(set)))
     {
-        d3dadapter9_Release(This);
+        adapter_set_destroy(set);
         return hr;
     }
 
     /* map absolute adapter IDs with internal adapters */
-    for (i = 0; i < This->ngroups; ++i)
+    for (i = 0; i < set->ngroups; ++i)
     {
-        for (j = 0; j < This->groups[i].noutputs; ++j)
+        for (j = 0; j < set->groups[i].noutputs; ++j)
         {
-            This->nadapters++;
+            set->nadapters++;
         }
     }
-    if (This->nadapters == 0)
+    if (set->nadapters == 0)
     {
         ERR("No available native adapters in system.\n");
-        d3dadapter9_Release(This);
+        adapter_set_destroy(set);
         return D3DERR_NOTAVAILABLE;
     }
 
-    This->map = calloc(This->nadapters, sizeof(struct adapter_map));
+    set->map = calloc(set->nadapters, sizeof(struct adapter_map));
 
-    if (!This->map)
+    if (!set->map)
     {
-        d3dadapter9_Release(This);
+        adapter_set_destroy(set);
         ERR("Out of memory.\n");
         return E_OUTOFMEMORY;
     }
-    for (i = k = 0; i < This->ngroups; ++i)
+    for (i = k = 0; i < set->ngroups; ++i)
     {
-        for (j = 0; j < This->groups[i].noutputs; ++j, ++k)
+        for (j = 0; j < set->groups[i].noutputs; ++j, ++k)
         {
-            This->map[k].master = k-j;
-            This->map[k].group = i;
+            set->map[k].master = k-j;
+            set->map[k].group = i;
         }
     }
 
+    *out = set;
+
+    return D3D_OK;
+}
+
+/* returns the shared adapter set, creating it on first use */
+static HRESULT adapter_set_acquire(struct adapter_set **out)
+{
+    HRESULT hr = D3D_OK;
+
+    pthread_mutex_lock(&adapter_set_mutex);
+    if (adapter_set)
+        adapter_set->refs++;
+    else
+        hr = adapter_set_create(&adapter_set);
+    *out = adapter_set;
+    pthread_mutex_unlock(&adapter_set_mutex);
+
+    return hr;
+}
+
+HRESULT d3dadapter9_new(BOOL ex, IDirect3D9Ex **ppOut)
+{
+    struct d3dadapter9 *This;
+    HRESULT hr;
+
+    This = calloc(1, sizeof(struct d3dadapter9));
+    if (!This)
+    {
+        ERR("Out of memory.\n");
+        return E_OUTOFMEMORY;
+    }
+
+    This->vtable = &d3dadapter9_vtable;
+    This->refs = 1;
+    This->ex = ex;
+
+    hr = adapter_set_acquire(&This->set);
+    if (FAILED(hr))
+    {
+        free(This);
+        return hr;
+    }
+
+    TRACE("Using adapter set %p.\n", This->set);
     *ppOut = (IDirect3D9Ex *)This;
 
     return D3D_OK;
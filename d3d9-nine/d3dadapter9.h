@@ -9,8 +9,7 @@
 #define __NINE_D3D9ADAPTER_H
 
 #include <d3d9.h>
-#include <X11/Xlib.h>
 
-HRESULT d3dadapter9_new(Display *gdi_display, BOOL ex, IDirect3D9Ex **ppOut);
+HRESULT d3dadapter9_new(BOOL ex, IDirect3D9Ex **ppOut);
 
 #endif /* __NINE_D3D9ADAPTER_H */
@@ -0,0 +1,178 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Wine D3D9 display mode cache
+ *
+ * Nine polls the display mode every frame to detect resolution changes.
+ * The current mode of each display is cached and only read again from SDL
+ * after SDL_DISPLAYEVENT or a RandR screen or CRTC change was seen. RandR
+ * events are received on a dedicated xcb connection and processed when a
+ * mode is queried.
+ */
+
+#include <d3d9types.h>
+#include <xcb/xcb.h>
+#include <xcb/randr.h>
+#include <stdlib.h>
+#include <SDL2/SDL.h>
+
+#include "../common/debug.h"
+#include "display.h"
+
+struct display
+{
+    SDL_DisplayMode mode;
+    BOOL valid;
+};
+
+static SDL_SpinLock display_init_lock;
+static SDL_mutex *display_mutex;
+static struct display *displays;
+static int ndisplays;
+
+static xcb_connection_t *display_xcb;
+static uint8_t display_randr_event_base;
+
+/* must be called with display_mutex held */
+static void display_invalidate_locked(void)
+{
+    free(displays);
+    displays = NULL;
+    ndisplays = 0;
+}
+
+static int display_event_watch(void *userdata, SDL_Event *event)
+{
+    if (event->type != SDL_DISPLAYEVENT)
+        return 0;
+
+    SDL_LockMutex(display_mutex);
+    display_invalidate_locked();
+    SDL_UnlockMutex(display_mutex);
+
+    return 0;
+}
+
+static void display_randr_init(void)
+{
+    const xcb_query_extension_reply_t *ext;
+    xcb_randr_query_version_reply_t *version;
+    xcb_screen_iterator_t iter;
+
+    display_xcb = xcb_connect(NULL, NULL);
+    if (xcb_connection_has_error(display_xcb))
+        goto fail;
+
+    ext = xcb_get_extension_data(display_xcb, &xcb_randr_id);
+    if (!ext || !ext->present)
+        goto fail;
+
+    version = xcb_randr_query_version_reply(display_xcb,
+            xcb_randr_query_version(display_xcb, 1, 2), NULL);
+    if (!version)
+        goto fail;
+    free(version);
+
+    display_randr_event_base = ext->first_event;
+
+    for (iter = xcb_setup_roots_iterator(xcb_get_setup(display_xcb)); iter.rem;
+            xcb_screen_next(&iter))
+    {
+        xcb_randr_select_input(display_xcb, iter.data->root,
+                XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE | XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE);
+    }
+    xcb_flush(display_xcb);
+    return;
+
+fail:
+    WARN("RandR not available, display modes are only refreshed on SDL events\n");
+    if (display_xcb)
+        xcb_disconnect(display_xcb);
+    display_xcb = NULL;
+}
+
+/* must be called with display_mutex held */
+static void display_process_xcb_events(void)
+{
+    xcb_generic_event_t *event;
+
+    if (!display_xcb)
+        return;
+
+    while ((event = xcb_poll_for_event(display_xcb)))
+    {
+        uint8_t type = event->response_type & ~0x80;
+
+        if (type == display_randr_event_base + XCB_RANDR_SCREEN_CHANGE_NOTIFY ||
+                type == display_randr_event_base + XCB_RANDR_NOTIFY)
+            display_invalidate_locked();
+        free(event);
+    }
+}
+
+static void display_init(void)
+{
+    /* SDL calls the watch with its event lock held, add it without holding display_mutex */
+    SDL_AtomicLock(&display_init_lock);
+    if (!display_mutex)
+    {
+        display_mutex = SDL_CreateMutex();
+        display_randr_init();
+        SDL_AddEventWatch(display_event_watch, NULL);
+    }
+    SDL_AtomicUnlock(&display_init_lock);
+}
+
+BOOL display_get_current_mode(int display, SDL_DisplayMode *mode)
+{
+    BOOL ret = TRUE;
+
+    if (display < 0)
+        return FALSE;
+
+    display_init();
+
+    SDL_LockMutex(display_mutex);
+    display_process_xcb_events();
+
+    if (!displays)
+    {
+        ndisplays = SDL_GetNumVideoDisplays();
+        if (ndisplays > 0)
+            displays = calloc(ndisplays, sizeof(*displays));
+        if (!displays)
+            ndisplays = 0;
+    }
+
+    if (display < ndisplays)
+    {
+        if (!displays[display].valid)
+        {
+            if (SDL_GetCurrentDisplayMode(display, &displays[display].mode) == 0)
+            {
+                displays[display].valid = TRUE;
+                TRACE("display %d: format=%s, w=%d, h=%d, refresh_rate=%d\n", display,
+                      SDL_GetPixelFormatName(displays[display].mode.format),
+                      displays[display].mode.w, displays[display].mode.h,
+                      displays[display].mode.refresh_rate);
+            }
+        }
+        ret = displays[display].valid;
+        if (ret)
+            *mode = displays[display].mode;
+    }
+    else
+        ret = FALSE;
+
+    SDL_UnlockMutex(display_mutex);
+
+    return ret;
+}
+
+void display_invalidate(void)
+{
+    display_init();
+
+    SDL_LockMutex(display_mutex);
+    display_invalidate_locked();
+    SDL_UnlockMutex(display_mutex);
+}
@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Wine D3D9 display mode cache
+ */
+
+#ifndef __NINE_DISPLAY_H
+#define __NINE_DISPLAY_H
+
+#include <d3d9types.h>
+#include <SDL2/SDL.h>
+
+/* current mode of an SDL display, cached until SDL or RandR report a change */
+BOOL display_get_current_mode(int display, SDL_DisplayMode *mode);
+
+/* drop the cached modes, e.g. after changing the mode through SDL */
+void display_invalidate(void);
+
+#endif /* __NINE_DISPLAY_H */
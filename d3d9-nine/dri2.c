@@ -23,6 +23,7 @@
 #include <GL/gl.h>
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
+#include <SDL2/SDL.h>
 
 #include "../common/debug.h"
 #include "backend.h"
@@ -32,6 +33,9 @@ const char * const lib_egl = "libEGL.so.1";
 
 static EGLDisplay display = NULL;
 static int display_ref = 0;
+/* serializes init, deinit and destroy, devices may be created concurrently */
+static SDL_SpinLock display_lock;
+static SDL_mutex *display_mutex;
 
 struct dri2_pixmap_priv {
     GLuint fbo_read;
@@ -40,6 +44,10 @@ struct dri2_pixmap_priv {
     GLuint texture_write;
     unsigned int width;
     unsigned int height;
+    unsigned int pixmap_width; /* differs from width when scaling */
+    unsigned int pixmap_height;
+    EGLSyncKHR fence; /* signalled when the last blit from the buffer is done,
+                       * set by the blit thread, taken with the job mutex */
     struct dri2_pixmap_priv *next;
 };
 
@@ -50,8 +58,22 @@ struct dri2_priv {
     int fd;
     EGLDisplay display;
     EGLContext context;
+    int init_ref; /* init is called by every present using the backend */
     void *h_egl;
 
+    /* The context stays current on a dedicated thread, which runs all GL
+     * work. The application's threads never switch contexts. */
+    SDL_Thread *thread;
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+    void (*job)(struct dri2_priv *p, void *data);
+    void *job_data;
+    unsigned job_serial;
+    unsigned job_done;
+    BOOL current;
+    BOOL quit;
+    BOOL fence_sync;
+
     /* egl */
     void *(*eglGetProcAddress)(const char *procname);
     EGLContext (*eglCreateContext)(EGLDisplay dpy, EGLConfig config, EGLContext share_context, const EGLint *attrib_list);
@@ -69,6 +91,9 @@ struct dri2_priv {
     EGLImageKHR (*eglCreateImageKHR)(EGLDisplay dpy, EGLContext ctx, EGLenum target, EGLClientBuffer buffer, const EGLint *attrib_list);
     EGLBoolean (*eglDestroyImageKHR)(EGLDisplay dpy, EGLImageKHR image);
     EGLDisplay (*eglGetPlatformDisplayEXT)(EGLenum platform, void *native_display, const EGLint *attrib_list);
+    EGLSyncKHR (*eglCreateSyncKHR)(EGLDisplay dpy, EGLenum type, const EGLint *attrib_list);
+    EGLBoolean (*eglDestroySyncKHR)(EGLDisplay dpy, EGLSyncKHR sync);
+    EGLint (*eglClientWaitSyncKHR)(EGLDisplay dpy, EGLSyncKHR sync, EGLint flags, EGLTimeKHR timeout);
 
     /* gl */
     void (*glFlush)(void);
@@ -146,7 +171,8 @@ static Bool dri2_authenticate(Display *dpy, XID window, uint32_t token)
     return authenticated;
 }
 
-static void *dri2_eglGetProcAddress(struct dri2_priv *priv, const char *procname)
+static void *dri2_eglGetProcAddress(struct dri2_priv *priv, const char *procname,
+        BOOL required)
 {
     void *p;
 
@@ -157,25 +183,26 @@ static void *dri2_eglGetProcAddress(struct dri2_priv *priv, const char *procname
     if (priv->eglGetProcAddress)
         p = priv->eglGetProcAddress(procname);
 
-    if (!p)
+    if (!p && required)
         ERR("%s is missing but required\n", procname);
 
     return p;
 }
 
-static BOOL dri2_create(Display *dpy, int screen, struct dri_backend_priv **priv)
+static BOOL dri2_create(Display *dpy, int screen, const struct dri_device *device,
+        struct dri_backend_priv **priv)
 {
     struct dri2_priv *p;
-    char *device;
+    char *node;
     int fd;
     Window root = RootWindow(dpy, screen);
     drm_auth_t auth;
 
-    if (!dri2_connect(dpy, root, XCB_DRI2_DRIVER_TYPE_DRI, &device))
+    if (!dri2_connect(dpy, root, XCB_DRI2_DRIVER_TYPE_DRI, &node))
         return FALSE;
 
-    fd = open(device, O_RDWR);
-    free(device);
+    fd = open(node, O_RDWR);
+    free(node);
     if (fd < 0)
         return FALSE;
 
@@ -210,9 +237,11 @@ static BOOL dri2_create(Display *dpy, int screen, struct dri_backend_priv **priv
     }
 
 #define DRI2_EGLGETPROCADDRESS(procname) \
-    p->procname = dri2_eglGetProcAddress(p, #procname); \
+    p->procname = dri2_eglGetProcAddress(p, #procname, TRUE); \
     if (!p->procname) \
         goto err_egl;
+#define DRI2_EGLGETPROCADDRESS_OPTIONAL(procname) \
+    p->procname = dri2_eglGetProcAddress(p, #procname, FALSE);
 
     DRI2_EGLGETPROCADDRESS(eglGetProcAddress);
     DRI2_EGLGETPROCADDRESS(eglCreateContext);
@@ -228,6 +257,10 @@ static BOOL dri2_create(Display *dpy, int screen, struct dri_backend_priv **priv
     DRI2_EGLGETPROCADDRESS(eglCreateImageKHR);
     DRI2_EGLGETPROCADDRESS(eglDestroyImageKHR);
     DRI2_EGLGETPROCADDRESS(eglGetPlatformDisplayEXT);
+    /* EGL_KHR_fence_sync, glFlush is used without it */
+    DRI2_EGLGETPROCADDRESS_OPTIONAL(eglCreateSyncKHR);
+    DRI2_EGLGETPROCADDRESS_OPTIONAL(eglDestroySyncKHR);
+    DRI2_EGLGETPROCADDRESS_OPTIONAL(eglClientWaitSyncKHR);
 
     DRI2_EGLGETPROCADDRESS(glFlush);
     DRI2_EGLGETPROCADDRESS(glTexParameteri);
@@ -243,6 +276,7 @@ static BOOL dri2_create(Display *dpy, int screen, struct dri_backend_priv **priv
     DRI2_EGLGETPROCADDRESS(glBlitFramebuffer);
 
 #undef DRI2_EGLGETPROCADDRESS
+#undef DRI2_EGLGETPROCADDRESS_OPTIONAL
 
     *priv = (struct dri_backend_priv *)p;
 
@@ -254,7 +288,131 @@ err_egl:
     return FALSE;
 }
 
-static BOOL dri2_init(struct dri_backend_priv *priv)
+static int dri2_thread(void *data)
+{
+    struct dri2_priv *p = data;
+    void (*job)(struct dri2_priv *p, void *data);
+
+    p->eglBindAPI(EGL_OPENGL_API);
+    p->current = p->eglMakeCurrent(p->display, EGL_NO_SURFACE, EGL_NO_SURFACE, p->context);
+    if (!p->current)
+        ERR("eglMakeCurrent failed with 0x%0X\n", p->eglGetError());
+
+    SDL_LockMutex(p->mutex);
+    while (!p->quit)
+    {
+        if (!p->job)
+        {
+            SDL_CondWait(p->cond, p->mutex);
+            continue;
+        }
+
+        job = p->job;
+        SDL_UnlockMutex(p->mutex);
+        job(p, p->job_data);
+        SDL_LockMutex(p->mutex);
+
+        p->job = NULL;
+        p->job_done++;
+        SDL_CondBroadcast(p->cond);
+    }
+    SDL_UnlockMutex(p->mutex);
+
+    p->eglMakeCurrent(p->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    return 0;
+}
+
+/* runs job on the blit thread and waits for it */
+static void dri2_run(struct dri2_priv *p, void (*job)(struct dri2_priv *p, void *data), void *data)
+{
+    unsigned serial;
+
+    SDL_LockMutex(p->mutex);
+    while (p->job)
+        SDL_CondWait(p->cond, p->mutex);
+
+    p->job = job;
+    p->job_data = data;
+    serial = ++p->job_serial;
+    SDL_CondBroadcast(p->cond);
+
+    /* later jobs may complete before this thread wakes up */
+    while ((int)(p->job_done - serial) < 0)
+        SDL_CondWait(p->cond, p->mutex);
+    SDL_UnlockMutex(p->mutex);
+}
+
+static void dri2_nop_job(struct dri2_priv *p, void *data)
+{
+}
+
+static BOOL dri2_start_thread(struct dri2_priv *p)
+{
+    p->mutex = SDL_CreateMutex();
+    p->cond = SDL_CreateCond();
+    if (!p->mutex || !p->cond)
+        goto fail;
+
+    p->quit = FALSE;
+    p->job = NULL;
+    p->job_serial = p->job_done = 0;
+    p->thread = SDL_CreateThread(dri2_thread, "DRI2 blit", p);
+    if (!p->thread)
+        goto fail;
+
+    /* wait until the context is current */
+    dri2_run(p, dri2_nop_job, NULL);
+    if (p->current)
+        return TRUE;
+
+    SDL_LockMutex(p->mutex);
+    p->quit = TRUE;
+    SDL_CondBroadcast(p->cond);
+    SDL_UnlockMutex(p->mutex);
+    SDL_WaitThread(p->thread, NULL);
+    p->thread = NULL;
+
+fail:
+    if (p->cond)
+        SDL_DestroyCond(p->cond);
+    if (p->mutex)
+        SDL_DestroyMutex(p->mutex);
+    p->cond = NULL;
+    p->mutex = NULL;
+    return FALSE;
+}
+
+static void dri2_stop_thread(struct dri2_priv *p)
+{
+    SDL_LockMutex(p->mutex);
+    p->quit = TRUE;
+    SDL_CondBroadcast(p->cond);
+    SDL_UnlockMutex(p->mutex);
+
+    SDL_WaitThread(p->thread, NULL);
+    SDL_DestroyCond(p->cond);
+    SDL_DestroyMutex(p->mutex);
+    p->thread = NULL;
+    p->cond = NULL;
+    p->mutex = NULL;
+}
+
+static void dri2_lock_display(void)
+{
+    SDL_AtomicLock(&display_lock);
+    if (!display_mutex)
+        display_mutex = SDL_CreateMutex();
+    SDL_AtomicUnlock(&display_lock);
+
+    SDL_LockMutex(display_mutex);
+}
+
+static void dri2_unlock_display(void)
+{
+    SDL_UnlockMutex(display_mutex);
+}
+
+static BOOL dri2_init_locked(struct dri_backend_priv *priv)
 {
     struct dri2_priv *p = (struct dri2_priv *)priv;
     EGLint major, minor;
@@ -273,6 +431,12 @@ static BOOL dri2_init(struct dri_backend_priv *priv)
         EGL_NONE
     };
 
+    if (p->init_ref)
+    {
+        p->init_ref++;
+        return TRUE;
+    }
+
     current_api = p->eglQueryAPI();
 
     if (!display)
@@ -296,6 +460,11 @@ static BOOL dri2_init(struct dri_backend_priv *priv)
             !strstr(extensions, "EGL_KHR_image_base"))
         goto clean_egl_display;
 
+    p->fence_sync = strstr(extensions, "EGL_KHR_fence_sync") && p->eglCreateSyncKHR &&
+            p->eglDestroySyncKHR && p->eglClientWaitSyncKHR;
+    if (!p->fence_sync)
+        WARN("EGL_KHR_fence_sync not supported, falling back to glFlush\n");
+
     if (!p->eglChooseConfig(display, config_attribs, &config, 1, &i))
         goto clean_egl_display;
 
@@ -306,11 +475,17 @@ static BOOL dri2_init(struct dri_backend_priv *priv)
     if (context == EGL_NO_CONTEXT)
         goto clean_egl_display;
 
-    p->eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
-
     p->display = display;
     p->context = context;
 
+    if (!dri2_start_thread(p))
+    {
+        p->eglDestroyContext(display, context);
+        goto clean_egl_display;
+    }
+
+    p->init_ref = 1;
+
     p->eglBindAPI(current_api);
     return TRUE;
 
@@ -320,6 +495,17 @@ clean_egl_display:
     return FALSE;
 }
 
+static BOOL dri2_init(struct dri_backend_priv *priv)
+{
+    BOOL ret;
+
+    dri2_lock_display();
+    ret = dri2_init_locked(priv);
+    dri2_unlock_display();
+
+    return ret;
+}
+
 static int dri2_get_fd(struct dri_backend_priv *priv)
 {
     struct dri2_priv *p = (struct dri2_priv *)priv;
@@ -327,154 +513,319 @@ static int dri2_get_fd(struct dri_backend_priv *priv)
     return p->fd;
 }
 
-static BOOL dri2_present_pixmap(struct dri_backend_priv *priv, struct buffer_priv *buffer_priv)
+/* waits for the last blit from the buffer, e.g. before Nine renders to it again */
+static void dri2_wait_fence(struct dri2_priv *p, struct dri2_pixmap_priv *pp)
 {
-    struct dri2_priv *p = (struct dri2_priv *)priv;
-    struct dri2_pixmap_priv *pp = (struct dri2_pixmap_priv *)buffer_priv;
-    EGLenum current_api = 0;
+    EGLSyncKHR fence;
 
-    current_api = p->eglQueryAPI();
-    p->eglBindAPI(EGL_OPENGL_API);
-    if (p->eglMakeCurrent(p->display, EGL_NO_SURFACE, EGL_NO_SURFACE, p->context))
+    SDL_LockMutex(p->mutex);
+    fence = pp->fence;
+    pp->fence = EGL_NO_SYNC_KHR;
+    SDL_UnlockMutex(p->mutex);
+
+    if (fence == EGL_NO_SYNC_KHR)
+        return;
+
+    /* flushed by the blit already */
+    if (p->eglClientWaitSyncKHR(p->display, fence, 0, EGL_FOREVER_KHR) == EGL_FALSE)
+        ERR("eglClientWaitSyncKHR failed with 0x%0X\n", p->eglGetError());
+    p->eglDestroySyncKHR(p->display, fence);
+}
+
+/* more dirty rects than this are blitted as their bounding box */
+#define DRI2_MAX_BLIT_RECTS 16
+
+struct dri2_blit
+{
+    struct dri2_pixmap_priv *pp;
+    RECT rects[DRI2_MAX_BLIT_RECTS];
+    unsigned nrects;
+};
+
+static BOOL dri2_intersect_rect(RECT *dst, const RECT *a, const RECT *b)
+{
+    dst->left = a->left > b->left ? a->left : b->left;
+    dst->top = a->top > b->top ? a->top : b->top;
+    dst->right = a->right < b->right ? a->right : b->right;
+    dst->bottom = a->bottom < b->bottom ? a->bottom : b->bottom;
+
+    return dst->left < dst->right && dst->top < dst->bottom;
+}
+
+static void dri2_union_rect(RECT *dst, const RECT *rc)
+{
+    if (rc->left < dst->left) dst->left = rc->left;
+    if (rc->top < dst->top) dst->top = rc->top;
+    if (rc->right > dst->right) dst->right = rc->right;
+    if (rc->bottom > dst->bottom) dst->bottom = rc->bottom;
+}
+
+/* Only the source rect, restricted to the dirty region, reaches the window.
+ * Collects the parts of the pixmap to copy. */
+static void dri2_damage_rects(struct dri2_blit *blit, const RECT *pSourceRect,
+        const RGNDATA *pDirtyRegion)
+{
+    struct dri2_pixmap_priv *pp = blit->pp;
+    RECT bounds = { 0, 0, pp->width, pp->height };
+    BOOL merged = FALSE;
+    RECT rc;
+    unsigned i;
+
+    blit->nrects = 0;
+
+    if (pSourceRect && !dri2_intersect_rect(&bounds, &bounds, pSourceRect))
+        return;
+
+    if (!pDirtyRegion || !pDirtyRegion->rdh.nCount)
+    {
+        blit->rects[blit->nrects++] = bounds;
+        return;
+    }
+
+    for (i = 0; i < pDirtyRegion->rdh.nCount; i++)
     {
-        p->glBindFramebuffer(GL_READ_FRAMEBUFFER, pp->fbo_read);
-        p->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, pp->fbo_write);
+        memcpy(&rc, pDirtyRegion->Buffer + i * sizeof(RECT), sizeof(RECT));
+        if (!dri2_intersect_rect(&rc, &rc, &bounds))
+            continue;
+
+        if (!merged && blit->nrects < DRI2_MAX_BLIT_RECTS)
+        {
+            blit->rects[blit->nrects++] = rc;
+            continue;
+        }
 
-        p->glBlitFramebuffer(0, 0, pp->width, pp->height, 0, 0, pp->width, pp->height,
+        /* too many rects, copy their bounding box instead */
+        while (blit->nrects > 1)
+            dri2_union_rect(&blit->rects[0], &blit->rects[--blit->nrects]);
+        dri2_union_rect(&blit->rects[0], &rc);
+        merged = TRUE;
+    }
+}
+
+static void dri2_blit_job(struct dri2_priv *p, void *data)
+{
+    struct dri2_blit *blit = data;
+    struct dri2_pixmap_priv *pp = blit->pp;
+    EGLSyncKHR fence = EGL_NO_SYNC_KHR;
+    unsigned i;
+
+    if (!blit->nrects)
+        return;
+
+    p->glBindFramebuffer(GL_READ_FRAMEBUFFER, pp->fbo_read);
+    p->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, pp->fbo_write);
+
+    if (pp->width != pp->pixmap_width || pp->height != pp->pixmap_height)
+    {
+        /* the copy is needed anyway, scaling it is almost free */
+        p->glBlitFramebuffer(0, 0, pp->width, pp->height,
+                0, 0, pp->pixmap_width, pp->pixmap_height,
+                GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    }
+    else for (i = 0; i < blit->nrects; i++)
+    {
+        const RECT *rc = &blit->rects[i];
+
+        p->glBlitFramebuffer(rc->left, rc->top, rc->right, rc->bottom,
+                rc->left, rc->top, rc->right, rc->bottom,
                 GL_COLOR_BUFFER_BIT, GL_NEAREST);
-        p->glFlush(); /* Perhaps useless */
     }
-    else
+
+    if (p->fence_sync)
+        fence = p->eglCreateSyncKHR(p->display, EGL_SYNC_FENCE_KHR, NULL);
+
+    if (fence == EGL_NO_SYNC_KHR)
     {
-        ERR("eglMakeCurrent failed with 0x%0X\n", p->eglGetError());
-        return FALSE;
+        p->glFlush();
+        return;
     }
 
-    p->eglMakeCurrent(p->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
-    p->eglBindAPI(current_api);
+    /* Submits the blit without waiting for it. The X server's reads of
+     * the pixmap are ordered after it by the kernel's implicit sync, Nine's
+     * next rendering to the buffer by dri2_wait_buffer_idle. */
+    p->eglClientWaitSyncKHR(p->display, fence, EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, 0);
+
+    SDL_LockMutex(p->mutex);
+    if (pp->fence != EGL_NO_SYNC_KHR)
+        p->eglDestroySyncKHR(p->display, pp->fence);
+    pp->fence = fence;
+    SDL_UnlockMutex(p->mutex);
+}
+
+static BOOL dri2_present_pixmap(struct dri_backend_priv *priv, struct buffer_priv *buffer_priv,
+        const RECT *pSourceRect, const RGNDATA *pDirtyRegion)
+{
+    struct dri2_priv *p = (struct dri2_priv *)priv;
+    struct dri2_blit blit;
+
+    blit.pp = (struct dri2_pixmap_priv *)buffer_priv;
+    dri2_damage_rects(&blit, pSourceRect, pDirtyRegion);
+
+    dri2_run(p, dri2_blit_job, &blit);
 
     return TRUE;
 }
 
+struct dri2_import
+{
+    EGLImageKHR image;
+    Pixmap pixmap;
+    GLuint texture_read, texture_write, fbo_read, fbo_write;
+    BOOL ret;
+};
+
+/* We bind the dma-buf to a EGLImage, then to a texture, and then to a fbo.
+ * Note that we can delete the EGLImage, but we shouldn't delete the texture,
+ * else the fbo is invalid */
+static void dri2_import_job(struct dri2_priv *p, void *data)
+{
+    struct dri2_import *import = data;
+    EGLImageKHR image = import->image;
+    int status;
+
+    import->ret = FALSE;
+
+    p->glGenTextures(1, &import->texture_read);
+    p->glBindTexture(GL_TEXTURE_2D, import->texture_read);
+    p->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    p->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    p->glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, image);
+    p->glGenFramebuffers(1, &import->fbo_read);
+    p->glBindFramebuffer(GL_FRAMEBUFFER, import->fbo_read);
+    p->glFramebufferTexture2D(GL_FRAMEBUFFER,
+                              GL_COLOR_ATTACHMENT0,
+                              GL_TEXTURE_2D, import->texture_read,
+                              0);
+    status = p->glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+        return;
+    p->glBindTexture(GL_TEXTURE_2D, 0);
+    p->eglDestroyImageKHR(p->display, image);
+
+    /* We bind a newly created pixmap (to which we want to copy the content)
+     * to an EGLImage, then to a texture, then to a fbo. */
+    image = p->eglCreateImageKHR(p->display, p->context, EGL_NATIVE_PIXMAP_KHR,
+                                 (void *)import->pixmap, NULL);
+    if (image == EGL_NO_IMAGE_KHR)
+        return;
+
+    p->glGenTextures(1, &import->texture_write);
+    p->glBindTexture(GL_TEXTURE_2D, import->texture_write);
+    p->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    p->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    p->glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, image);
+    p->glGenFramebuffers(1, &import->fbo_write);
+    p->glBindFramebuffer(GL_FRAMEBUFFER, import->fbo_write);
+    p->glFramebufferTexture2D(GL_FRAMEBUFFER,
+                              GL_COLOR_ATTACHMENT0,
+                              GL_TEXTURE_2D, import->texture_write,
+                              0);
+    status = p->glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+        return;
+    p->glBindTexture(GL_TEXTURE_2D, 0);
+    p->eglDestroyImageKHR(p->display, image);
+
+    import->ret = TRUE;
+}
+
+/* the layout of Nine's back buffer formats */
+static uint32_t dri2_fourcc(int depth, int bpp)
+{
+    switch (bpp)
+    {
+    case 16:
+        if (depth == 15)
+            return DRM_FORMAT_XRGB1555;
+        if (depth == 16)
+            return DRM_FORMAT_RGB565;
+        break;
+    case 32:
+        if (depth == 24)
+            return DRM_FORMAT_XRGB8888;
+        if (depth == 30)
+            return DRM_FORMAT_ARGB2101010;
+        if (depth == 32)
+            return DRM_FORMAT_ARGB8888;
+        break;
+    }
+    return 0;
+}
+
 static BOOL dri2_present(struct dri_backend_priv *priv, int fd, int width, int height, int stride,
-        int depth, int bpp, struct buffer_priv **buffer_priv, Pixmap *pixmap)
+        int depth, int bpp, int pixmap_width, int pixmap_height,
+        struct buffer_priv **buffer_priv, Pixmap *pixmap)
 {
     struct dri2_priv *p = (struct dri2_priv *)priv;
     struct dri2_pixmap_priv *pp;
+    struct dri2_import import;
     EGLImageKHR image;
-    GLuint texture_read, texture_write, fbo_read, fbo_write;
     EGLint attribs[] = {
         EGL_WIDTH, 0,
         EGL_HEIGHT, 0,
-        EGL_LINUX_DRM_FOURCC_EXT, DRM_FORMAT_ARGB8888,
+        EGL_LINUX_DRM_FOURCC_EXT, 0,
         EGL_DMA_BUF_PLANE0_FD_EXT, 0,
         EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
         EGL_DMA_BUF_PLANE0_PITCH_EXT, 0,
         EGL_NONE
     };
-    EGLenum current_api = 0;
-    int status;
 
     TRACE("fd=%d, width=%d, height=%d, stride=%d, depth=%d, bpp=%d\n",
           fd, width, height, stride, depth, bpp);
 
+    attribs[5] = dri2_fourcc(depth, bpp);
+    if (!attribs[5])
+    {
+        ERR("Unsupported depth %d with bpp %d\n", depth, bpp);
+        return FALSE;
+    }
+
     attribs[1] = width;
     attribs[3] = height;
     attribs[7] = fd;
     attribs[11] = stride;
 
-    current_api = p->eglQueryAPI();
-    p->eglBindAPI(EGL_OPENGL_API);
-
-    /* We bind the dma-buf to a EGLImage, then to a texture, and then to a fbo.
-     * Note that we can delete the EGLImage, but we shouldn't delete the texture,
-     * else the fbo is invalid */
-
     image = p->eglCreateImageKHR(p->display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT,
                                  NULL, attribs);
 
     if (image == EGL_NO_IMAGE_KHR) {
         ERR("eglCreateImageKHR failed with 0x%0X\n", p->eglGetError());
-        goto fail;
+        return FALSE;
     }
     close(fd);
 
-    if (p->eglMakeCurrent(p->display, EGL_NO_SURFACE, EGL_NO_SURFACE, p->context))
-    {
-        p->glGenTextures(1, &texture_read);
-        p->glBindTexture(GL_TEXTURE_2D, texture_read);
-        p->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        p->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        p->glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, image);
-        p->glGenFramebuffers(1, &fbo_read);
-        p->glBindFramebuffer(GL_FRAMEBUFFER, fbo_read);
-        p->glFramebufferTexture2D(GL_FRAMEBUFFER,
-                                  GL_COLOR_ATTACHMENT0,
-                                  GL_TEXTURE_2D, texture_read,
-                                  0);
-        status = p->glCheckFramebufferStatus(GL_FRAMEBUFFER);
-        if (status != GL_FRAMEBUFFER_COMPLETE)
-            goto fail;
-        p->glBindTexture(GL_TEXTURE_2D, 0);
-        p->eglDestroyImageKHR(p->display, image);
-
-        /* We bind a newly created pixmap (to which we want to copy the content)
-         * to an EGLImage, then to a texture, then to a fbo. */
-        image = p->eglCreateImageKHR(p->display, p->context, EGL_NATIVE_PIXMAP_KHR,
-                                     (void *)*pixmap, NULL);
-        if (image == EGL_NO_IMAGE_KHR)
-            goto fail;
-
-        p->glGenTextures(1, &texture_write);
-        p->glBindTexture(GL_TEXTURE_2D, texture_write);
-        p->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        p->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        p->glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, image);
-        p->glGenFramebuffers(1, &fbo_write);
-        p->glBindFramebuffer(GL_FRAMEBUFFER, fbo_write);
-        p->glFramebufferTexture2D(GL_FRAMEBUFFER,
-                                  GL_COLOR_ATTACHMENT0,
-                                  GL_TEXTURE_2D, texture_write,
-                                  0);
-        status = p->glCheckFramebufferStatus(GL_FRAMEBUFFER);
-        if (status != GL_FRAMEBUFFER_COMPLETE)
-            goto fail;
-        p->glBindTexture(GL_TEXTURE_2D, 0);
-        p->eglDestroyImageKHR(p->display, image);
-    }
-    else
-        ERR("eglMakeCurrent failed with 0x%0X\n", p->eglGetError());
-
-    p->eglMakeCurrent(p->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    import.image = image;
+    import.pixmap = *pixmap;
+    dri2_run(p, dri2_import_job, &import);
+    if (!import.ret)
+        return FALSE;
 
     pp = calloc(1, sizeof(struct dri2_pixmap_priv));
 
     if (!pp)
-        goto fail;
+        return FALSE;
 
-    pp->fbo_read = fbo_read;
-    pp->fbo_write = fbo_write;
-    pp->texture_read = texture_read;
-    pp->texture_write = texture_write;
+    pp->fbo_read = import.fbo_read;
+    pp->fbo_write = import.fbo_write;
+    pp->texture_read = import.texture_read;
+    pp->texture_write = import.texture_write;
     pp->width = width;
     pp->height = height;
+    pp->pixmap_width = pixmap_width;
+    pp->pixmap_height = pixmap_height;
+    pp->fence = EGL_NO_SYNC_KHR;
     pp->next = p->first_dri2_priv;
     p->first_dri2_priv = pp;
 
     *buffer_priv = (struct buffer_priv *)pp;
 
-    p->eglBindAPI(current_api);
-
     return TRUE;
-fail:
-    p->eglMakeCurrent(p->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
-    p->eglBindAPI(current_api);
-    return FALSE;
 }
 
 static BOOL dri2_window_buffer_from_dmabuf(struct dri_backend_priv *priv,
     PRESENTpriv *present_priv, int fd, int width, int height,
-    int stride, int depth, int bpp, struct D3DWindowBuffer **out)
+    int stride, int depth, int bpp, int pixmap_width, int pixmap_height,
+    struct D3DWindowBuffer **out)
 {
     struct dri2_priv *p = (struct dri2_priv *)priv;
     Pixmap pixmap;
@@ -489,7 +840,7 @@ static BOOL dri2_window_buffer_from_dmabuf(struct dri_backend_priv *priv,
         return FALSE;
 
     if (!PRESENTPixmapCreate(present_priv, p->screen, &pixmap,
-            width, height, stride, depth, bpp))
+            pixmap_width, pixmap_height, stride, depth, bpp))
     {
         free(*out);
         ERR("Failed to create pixmap\n");
@@ -497,7 +848,7 @@ static BOOL dri2_window_buffer_from_dmabuf(struct dri_backend_priv *priv,
     }
 
     if (!dri2_present(priv, fd, width, height, stride, depth, bpp,
-            &(*out)->priv, &pixmap))
+            pixmap_width, pixmap_height, &(*out)->priv, &pixmap))
     {
         ERR("dri2_present failed\n");
         free(*out);
@@ -514,16 +865,32 @@ static BOOL dri2_window_buffer_from_dmabuf(struct dri_backend_priv *priv,
     return TRUE;
 }
 
+static void dri2_wait_buffer_idle(struct dri_backend_priv *priv, struct buffer_priv *buffer_priv)
+{
+    dri2_wait_fence((struct dri2_priv *)priv, (struct dri2_pixmap_priv *)buffer_priv);
+}
+
 static BOOL dri2_copy_front(PRESENTPixmapPriv *present_pixmap_priv)
 {
     return FALSE;
 }
 
+static void dri2_delete_job(struct dri2_priv *p, void *data)
+{
+    struct dri2_pixmap_priv *pp = data;
+
+    dri2_wait_fence(p, pp);
+
+    p->glDeleteFramebuffers(1, &pp->fbo_read);
+    p->glDeleteFramebuffers(1, &pp->fbo_write);
+    p->glDeleteTextures(1, &pp->texture_read);
+    p->glDeleteTextures(1, &pp->texture_write);
+}
+
 static void dri2_destroy_pixmap(struct dri_backend_priv *priv, struct buffer_priv *buffer_priv)
 {
     struct dri2_priv *p = (struct dri2_priv *)priv;
     struct dri2_pixmap_priv *pp = (struct dri2_pixmap_priv *)buffer_priv;
-    EGLenum current_api;
 
     if (p->first_dri2_priv == pp)
     {
@@ -539,32 +906,21 @@ static void dri2_destroy_pixmap(struct dri_backend_priv *priv, struct buffer_pri
         current->next = pp->next;
     }
 
-    current_api = p->eglQueryAPI();
-
-    p->eglBindAPI(EGL_OPENGL_API);
-    if (p->eglMakeCurrent(p->display, EGL_NO_SURFACE, EGL_NO_SURFACE, p->context))
-    {
-        p->glDeleteFramebuffers(1, &pp->fbo_read);
-        p->glDeleteFramebuffers(1, &pp->fbo_write);
-        p->glDeleteTextures(1, &pp->texture_read);
-        p->glDeleteTextures(1, &pp->texture_write);
-    }
-    else
-        ERR("eglMakeCurrent failed with 0x%0X\n", p->eglGetError());
-
-    p->eglMakeCurrent(p->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
-    p->eglBindAPI(current_api);
+    dri2_run(p, dri2_delete_job, pp);
 
     free(pp);
 }
 
 /* hypothesis: at this step all textures, etc are destroyed */
-static void dri2_deinit(struct dri_backend_priv *priv)
+static void dri2_deinit_locked(struct dri_backend_priv *priv)
 {
     struct dri2_priv *p = (struct dri2_priv *)priv;
     EGLenum current_api;
     struct dri2_pixmap_priv *current;
 
+    if (--p->init_ref > 0)
+        return;
+
     current = p->first_dri2_priv;
     while (current)
     {
@@ -573,9 +929,11 @@ static void dri2_deinit(struct dri_backend_priv *priv)
         current = next;
     }
 
+    /* releases the context */
+    dri2_stop_thread(p);
+
     current_api = p->eglQueryAPI();
     p->eglBindAPI(EGL_OPENGL_API);
-    p->eglMakeCurrent(p->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
     p->eglDestroyContext(p->display, p->context);
     if (display)
     {
@@ -590,12 +948,21 @@ static void dri2_deinit(struct dri_backend_priv *priv)
     p->eglBindAPI(current_api);
 }
 
+static void dri2_deinit(struct dri_backend_priv *priv)
+{
+    dri2_lock_display();
+    dri2_deinit_locked(priv);
+    dri2_unlock_display();
+}
+
 static void dri2_destroy(struct dri_backend_priv *priv)
 {
     struct dri2_priv *p = (struct dri2_priv *)priv;
 
+    dri2_lock_display();
     if (!display_ref)
         dlclose(p->h_egl);
+    dri2_unlock_display();
 
     close(p->fd);
 
@@ -641,6 +1008,7 @@ static BOOL dri2_probe(Display *dpy)
 
 const struct dri_backend_funcs dri2_funcs = {
     .name = "dri2",
+    .can_scale = TRUE,
     .probe = dri2_probe,
     .create = dri2_create,
     .destroy = dri2_destroy,
@@ -648,6 +1016,7 @@ const struct dri_backend_funcs dri2_funcs = {
     .deinit = dri2_deinit,
     .get_fd = dri2_get_fd,
     .window_buffer_from_dmabuf = dri2_window_buffer_from_dmabuf,
+    .wait_buffer_idle = dri2_wait_buffer_idle,
     .copy_front = dri2_copy_front,
     .present_pixmap = dri2_present_pixmap,
     .destroy_pixmap = dri2_destroy_pixmap,
@@ -23,9 +23,9 @@ struct dri3_priv {
     int fd;
 };
 
-static BOOL dri3_create(Display *dpy, int screen, struct dri_backend_priv **priv)
+/* the device the X server renders with */
+static int dri3_open(Display *dpy, int screen)
 {
-    struct dri3_priv *p;
     xcb_dri3_open_cookie_t cookie;
     xcb_dri3_open_reply_t *reply;
     xcb_connection_t *xcb_connection = XGetXCBConnection(dpy);
@@ -36,12 +36,12 @@ static BOOL dri3_create(Display *dpy, int screen, struct dri_backend_priv **priv
 
     reply = xcb_dri3_open_reply(xcb_connection, cookie, NULL);
     if (!reply)
-        return FALSE;
+        return -1;
 
     if (reply->nfd != 1)
     {
         free(reply);
-        return FALSE;
+        return -1;
     }
 
     fd = xcb_dri3_open_reply_fds(xcb_connection, reply)[0];
@@ -49,6 +49,22 @@ static BOOL dri3_create(Display *dpy, int screen, struct dri_backend_priv **priv
 
     free(reply);
 
+    return fd;
+}
+
+static BOOL dri3_create(Display *dpy, int screen, const struct dri_device *device,
+        struct dri_backend_priv **priv)
+{
+    struct dri3_priv *p;
+    int fd;
+
+    /* Buffers of other GPUs are usually tiled and in VRAM, the server can't
+     * use them without a linear copy to its own GPU, which Nine doesn't do.
+     * DRI3 doesn't enumerate devices, device is always NULL. */
+    fd = dri3_open(dpy, screen);
+    if (fd < 0)
+        return FALSE;
+
     p = calloc(1, sizeof(struct dri3_priv));
     if (!p)
     {
@@ -92,7 +108,8 @@ static int dri3_get_fd(struct dri_backend_priv *priv)
 
 static BOOL dri3_window_buffer_from_dmabuf(struct dri_backend_priv *priv,
     PRESENTpriv *present_priv, int fd, int width, int height,
-    int stride, int depth, int bpp, struct D3DWindowBuffer **out)
+    int stride, int depth, int bpp, int pixmap_width, int pixmap_height,
+    struct D3DWindowBuffer **out)
 {
     struct dri3_priv *p = (struct dri3_priv *)priv;
     Pixmap pixmap;
@@ -142,7 +159,8 @@ static BOOL dri3_copy_front(PRESENTPixmapPriv *present_pixmap_priv)
     return PRESENTHelperCopyFront(present_pixmap_priv);
 }
 
-static BOOL dri3_present_pixmap(struct dri_backend_priv *priv, struct buffer_priv *buffer_priv)
+static BOOL dri3_present_pixmap(struct dri_backend_priv *priv, struct buffer_priv *buffer_priv,
+        const RECT *pSourceRect, const RGNDATA *pDirtyRegion)
 {
     return TRUE;
 }
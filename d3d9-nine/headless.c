@@ -0,0 +1,277 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Wine D3D9 headless backend
+ *
+ * Renders on a DRM render node without an X server, e.g. for render farms
+ * or benchmarking the CPU overhead of Nine. Presented frames are discarded,
+ * or read back and handed to the callback set with D3D9SDL_SetFrameCallback.
+ * Presents with an interval wait for a simulated vblank.
+ */
+
+#include <d3d9.h>
+#include <d3d9_sdl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/dma-buf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <SDL2/SDL.h>
+
+#include "../common/debug.h"
+#include "backend.h"
+#include "headless.h"
+
+struct headless_priv {
+    int fd;
+    uint64_t period; /* of the simulated vblank, in us */
+    uint64_t last_vblank;
+};
+
+struct headless_buffer {
+    int fd; /* dma-buf */
+    int width;
+    int height;
+    int stride;
+    void *map; /* mapped on the first readback */
+};
+
+static SDL_SpinLock callback_lock;
+static D3D9SDL_FRAMECALLBACK frame_callback;
+static void *frame_callback_user;
+
+void headless_set_frame_callback(D3D9SDL_FRAMECALLBACK callback, void *user)
+{
+    SDL_AtomicLock(&callback_lock);
+    frame_callback = callback;
+    frame_callback_user = user;
+    SDL_AtomicUnlock(&callback_lock);
+}
+
+static uint64_t headless_get_ust(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static BOOL headless_probe(Display *dpy)
+{
+    struct dri_device device;
+
+    return backend_scan_devices(-1, &device, 1) > 0;
+}
+
+static int headless_enumerate(Display *dpy, int screen, struct dri_device *devices, int max)
+{
+    /* without an X server no device is the default one */
+    return backend_scan_devices(-1, devices, max);
+}
+
+static BOOL headless_create(Display *dpy, int screen, const struct dri_device *device,
+        struct dri_backend_priv **priv)
+{
+    struct dri_device first;
+    struct headless_priv *p;
+    const char *env;
+    int fd, hz;
+
+    if (!device)
+    {
+        if (backend_scan_devices(-1, &first, 1) <= 0)
+            return FALSE;
+        device = &first;
+    }
+
+    fd = open(device->node, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+    {
+        ERR("Failed to open %s\n", device->node);
+        return FALSE;
+    }
+
+    p = calloc(1, sizeof(struct headless_priv));
+    if (!p)
+    {
+        close(fd);
+        return FALSE;
+    }
+
+    env = getenv("D3D_HEADLESS_HZ");
+    hz = env ? atoi(env) : 0;
+    if (hz <= 0)
+        hz = 60;
+
+    p->fd = fd;
+    p->period = 1000000 / hz;
+
+    TRACE("Rendering on %s, simulated vblank at %d Hz\n", device->node, hz);
+
+    *priv = (struct dri_backend_priv *)p;
+
+    return TRUE;
+}
+
+static void headless_destroy(struct dri_backend_priv *priv)
+{
+    struct headless_priv *p = (struct headless_priv *)priv;
+
+    close(p->fd);
+
+    free(p);
+}
+
+static BOOL headless_init(struct dri_backend_priv *priv)
+{
+    return TRUE;
+}
+
+static void headless_deinit(struct dri_backend_priv *priv)
+{
+}
+
+static int headless_get_fd(struct dri_backend_priv *priv)
+{
+    struct headless_priv *p = (struct headless_priv *)priv;
+
+    return p->fd;
+}
+
+static BOOL headless_window_buffer_from_dmabuf(struct dri_backend_priv *priv,
+    PRESENTpriv *present_priv, int fd, int width, int height,
+    int stride, int depth, int bpp, int pixmap_width, int pixmap_height,
+    struct D3DWindowBuffer **out)
+{
+    struct headless_buffer *buffer;
+
+    TRACE("dmaBufFd=%d, width=%d, height=%d, stride=%d\n", fd, width, height, stride);
+
+    if (!out)
+        return FALSE;
+
+    *out = calloc(1, sizeof(struct D3DWindowBuffer));
+    buffer = calloc(1, sizeof(struct headless_buffer));
+    if (!*out || !buffer)
+    {
+        free(*out);
+        free(buffer);
+        return FALSE;
+    }
+
+    buffer->fd = fd;
+    buffer->width = width;
+    buffer->height = height;
+    buffer->stride = stride;
+
+    (*out)->priv = (struct buffer_priv *)buffer;
+    return TRUE;
+}
+
+static BOOL headless_copy_front(PRESENTPixmapPriv *present_pixmap_priv)
+{
+    /* nothing is on screen, the buffer keeps its content */
+    return TRUE;
+}
+
+static BOOL headless_present_pixmap(struct dri_backend_priv *priv, struct buffer_priv *buffer_priv,
+        const RECT *pSourceRect, const RGNDATA *pDirtyRegion)
+{
+    return TRUE;
+}
+
+static void headless_readback(struct headless_buffer *buffer,
+        D3D9SDL_FRAMECALLBACK callback, void *user)
+{
+    struct dma_buf_sync sync = { 0 };
+    size_t size = (size_t)buffer->stride * buffer->height;
+
+    if (!buffer->map)
+    {
+        buffer->map = mmap(NULL, size, PROT_READ, MAP_SHARED, buffer->fd, 0);
+        if (buffer->map == MAP_FAILED)
+        {
+            buffer->map = NULL;
+            ERR("Failed to map the buffer, errno %d\n", errno);
+            return;
+        }
+    }
+
+    /* waits for the rendering to finish */
+    sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+    ioctl(buffer->fd, DMA_BUF_IOCTL_SYNC, &sync);
+
+    callback(buffer->map, buffer->width, buffer->height, buffer->stride, user);
+
+    sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+    ioctl(buffer->fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+/* waits for the simulated vblank interval frames after the last one */
+static void headless_wait_vblank(struct headless_priv *p, UINT interval)
+{
+    uint64_t now = headless_get_ust();
+    uint64_t target = p->last_vblank + interval * p->period;
+    struct timespec ts;
+
+    /* late, continue on the next vblank of the same grid */
+    if (target < now)
+        target = now + p->period - (now - p->last_vblank) % p->period;
+
+    ts.tv_sec = target / 1000000;
+    ts.tv_nsec = (target % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+
+    p->last_vblank = target;
+}
+
+static BOOL headless_present_buffer(struct dri_backend_priv *priv, struct buffer_priv *buffer_priv,
+        UINT interval)
+{
+    struct headless_priv *p = (struct headless_priv *)priv;
+    struct headless_buffer *buffer = (struct headless_buffer *)buffer_priv;
+    D3D9SDL_FRAMECALLBACK callback;
+    void *user;
+
+    SDL_AtomicLock(&callback_lock);
+    callback = frame_callback;
+    user = frame_callback_user;
+    SDL_AtomicUnlock(&callback_lock);
+
+    if (callback)
+        headless_readback(buffer, callback, user);
+
+    if (interval)
+        headless_wait_vblank(p, interval);
+
+    return TRUE;
+}
+
+static void headless_destroy_pixmap(struct dri_backend_priv *priv, struct buffer_priv *buffer_priv)
+{
+    struct headless_buffer *buffer = (struct headless_buffer *)buffer_priv;
+
+    if (buffer->map)
+        munmap(buffer->map, (size_t)buffer->stride * buffer->height);
+    close(buffer->fd);
+
+    free(buffer);
+}
+
+const struct dri_backend_funcs headless_funcs = {
+    .name = "headless",
+    .probe = headless_probe,
+    .enumerate = headless_enumerate,
+    .create = headless_create,
+    .destroy = headless_destroy,
+    .init = headless_init,
+    .deinit = headless_deinit,
+    .get_fd = headless_get_fd,
+    .window_buffer_from_dmabuf = headless_window_buffer_from_dmabuf,
+    .copy_front = headless_copy_front,
+    .present_pixmap = headless_present_pixmap,
+    .present_buffer = headless_present_buffer,
+    .destroy_pixmap = headless_destroy_pixmap,
+};
@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Wine D3D9 headless backend
+ */
+
+#ifndef __NINE_HEADLESS_H
+#define __NINE_HEADLESS_H
+
+#include <d3d9.h>
+#include <d3d9_sdl.h>
+
+/* NULL discards the presented frames */
+void headless_set_frame_callback(D3D9SDL_FRAMECALLBACK callback, void *user);
+
+#endif /* __NINE_HEADLESS_H */
@@ -17,12 +17,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <dlfcn.h>
+#include <pthread.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_syswm.h>
 
 #include "../common/debug.h"
 #include "../common/library.h"
 #include "backend.h"
+#include "display.h"
+#include "sync.h"
+#include "window.h"
 #include "xcb_present.h"
 
 #ifndef D3DPRESENT_DONOTWAIT
@@ -49,6 +53,11 @@
 
 static const struct D3DAdapter9DRM *d3d9_drm = NULL;
 
+/* minimum time between two warnings about copied fullscreen frames */
+#define PRESENT_COPY_WARN_MS 10000
+/* copied frames in a row before D3D_BYPASS_COMPOSITOR unredirects the window */
+#define PRESENT_BYPASS_STREAK 120
+
 /* Start section of x11drv.h */
 #define X11DRV_ESCAPE 6789
 enum x11drv_escape_codes
@@ -84,6 +93,8 @@ struct d3d_drawable
     unsigned int depth;
 };
 
+struct DRIPresentGroup;
+
 struct DRIPresent
 {
     /* COM vtable */
@@ -95,12 +106,15 @@ struct DRIPresent
 
     D3DPRESENT_PARAMETERS params;
     HWND focus_wnd;
+    HWND tracked_wnd; /* window acquired for state tracking */
     PRESENTpriv *present_priv;
 
     SDL_Cursor* hCursor;
 
     BOOL ex;
     BOOL no_window_changes;
+    BOOL fullscreen_desktop;
+    BOOL backend_scaling; /* the backend scales the back buffer to the window */
 
     UINT present_interval;
     BOOL present_async;
@@ -108,9 +122,58 @@ struct DRIPresent
     BOOL allow_discard_delayed_release;
     BOOL tear_free_discard;
 
+    BOOL vrr;
+    int vrr_min_hz;
+    int vrr_max_hz;
+
+    BOOL timed; /* a present had a target time, report when they complete */
+
+    /* flip or copy, as reported by PRESENT */
+    unsigned flips;
+    unsigned copies;
+    Uint32 copy_warn_ticks;
+    BOOL bypass_fallback; /* unredirect borderless windows that keep being copied */
+    HWND bypass_wnd;
+
+    int background_fps; /* frame rate limit while the window has no focus */
+    Uint64 last_present;
+
+    /* state applied by SetPresentParameters, to skip redundant changes */
+    HWND mode_wnd;
+    SDL_DisplayMode mode;
+    Window fullscreen_props_window;
+    Atom atom_bypass_compositor;
+    Atom atom_variable_refresh;
+
+    /* multihead */
+    struct DRIPresentGroup *group; /* set when the group has several heads */
+    int display; /* SDL display of the head, -1 if unknown */
+    HWND own_wnd; /* window created for a head without device window */
+
     struct dri_backend *dri_backend;
 };
 
+/* a frame of one head, waiting for the other heads */
+struct head_frame
+{
+    struct DRIPresent *present;
+    struct D3DWindowBuffer *buffer;
+    HWND hwnd;
+    XID xid;
+    RECT source_rect;
+    RECT dest_rect;
+    BOOL has_source_rect;
+    BOOL has_dest_rect;
+    RGNDATA *dirty_region;
+};
+
+/* a frame held in a sync group */
+struct sync_present
+{
+    struct sync_frame sync;
+    struct head_frame head;
+};
+
 struct DRIPresentGroup
 {
     /* COM vtable */
@@ -126,6 +189,11 @@ struct DRIPresentGroup
     unsigned npresent_backends;
     Display *gdi_display;
     struct dri_backend *dri_backend;
+
+    /* heads queue their frames, the last one submits all of them at once */
+    SDL_mutex *heads_mutex;
+    struct head_frame *frames;
+    unsigned nframes;
 };
 
 static SDL_PixelFormatEnum to_sdl_format(D3DFORMAT d3d_format)
@@ -176,6 +244,53 @@ D3DFORMAT to_d3d_format(DWORD sdl_format)
     }
 }
 
+static BOOL present_getenv_bool(const char *name)
+{
+    const char *env = getenv(name);
+
+    return env && strtol(env, NULL, 0);
+}
+
+static int present_getenv_int(const char *name, int def)
+{
+    const char *env = getenv(name);
+
+    return env ? strtol(env, NULL, 0) : def;
+}
+
+static void update_vrr(struct DRIPresent *This)
+{
+    if (This->present_priv)
+        PRESENTSetVRR(This->present_priv, This->vrr, This->vrr_min_hz, This->vrr_max_hz);
+}
+
+/* On a fullscreen window a display mode change is a full modeset,
+ * so only set it when it differs from the one set last time. */
+static BOOL set_window_display_mode(struct DRIPresent *This, HWND hwnd,
+        const SDL_DisplayMode *mode)
+{
+    /* desktop fullscreen keeps the current mode and scales instead */
+    if (This->fullscreen_desktop)
+        return TRUE;
+
+    if (This->mode_wnd == hwnd && This->mode.format == mode->format &&
+            This->mode.w == mode->w && This->mode.h == mode->h &&
+            This->mode.refresh_rate == mode->refresh_rate)
+        return TRUE;
+
+    if (SDL_SetWindowDisplayMode(hwnd, mode) < 0)
+    {
+        ERR("Failed to set window display mode with error %s\n", SDL_GetError());
+        This->mode_wnd = NULL;
+        return FALSE;
+    }
+
+    This->mode_wnd = hwnd;
+    This->mode = *mode;
+    display_invalidate();
+    return TRUE;
+}
+
 static void update_presentation_interval(struct DRIPresent *This)
 {
     switch(This->params.PresentationInterval)
@@ -218,6 +333,331 @@ static void update_presentation_interval(struct DRIPresent *This)
           This->allow_discard_delayed_release));
 }
 
+/* a borderless window covering its display, where a flip would be possible */
+static BOOL present_covers_display(HWND hwnd)
+{
+    SDL_Rect bounds;
+    int x, y, w, h;
+
+    if (!(SDL_GetWindowFlags(hwnd) & SDL_WINDOW_BORDERLESS) ||
+            SDL_GetDisplayBounds(SDL_GetWindowDisplayIndex(hwnd), &bounds) < 0)
+        return FALSE;
+
+    SDL_GetWindowPosition(hwnd, &x, &y);
+    SDL_GetWindowSize(hwnd, &w, &h);
+    return x == bounds.x && y == bounds.y && w == bounds.w && h == bounds.h;
+}
+
+/* ask the compositor to unredirect the window, so PRESENT can flip,
+ * or to composite it again */
+static void present_bypass_compositor(struct DRIPresent *This, HWND hwnd, BOOL bypass)
+{
+    SDL_SysWMinfo wm;
+    int bypass_value = 1;
+
+    SDL_VERSION(&wm.version);
+    if (!SDL_GetWindowWMInfo(hwnd, &wm) || wm.subsystem != SDL_SYSWM_X11)
+        return;
+
+    if (!This->atom_bypass_compositor)
+        This->atom_bypass_compositor = XInternAtom(wm.info.x11.display,
+                                                   "_NET_WM_BYPASS_COMPOSITOR",
+                                                   False);
+    if (bypass)
+        XChangeProperty(wm.info.x11.display, wm.info.x11.window,
+                        This->atom_bypass_compositor, XA_CARDINAL, 32,
+                        PropModeReplace, (unsigned char *)&bypass_value, 1);
+    else
+        XDeleteProperty(wm.info.x11.display, wm.info.x11.window,
+                        This->atom_bypass_compositor);
+    XFlush(wm.info.x11.display);
+}
+
+/* undo present_bypass_compositor, e.g. when the window doesn't cover its display anymore */
+static void present_restore_compositor(struct DRIPresent *This)
+{
+    if (!This->bypass_wnd)
+        return;
+
+    TRACE("Window %p is composited again\n", This->bypass_wnd);
+    present_bypass_compositor(This, This->bypass_wnd, FALSE);
+    This->bypass_wnd = NULL;
+}
+
+static void present_count_flips(struct DRIPresent *This, HWND hwnd)
+{
+    unsigned flips, copies;
+    UINT streak;
+    Uint32 now;
+
+    if (This->bypass_wnd && (This->bypass_wnd != hwnd || !present_covers_display(hwnd)))
+        present_restore_compositor(This);
+
+    PRESENTGetFlipStats(This->present_priv, &flips, &copies);
+    if (flips == This->flips && copies == This->copies)
+        return;
+
+    streak = window_count_presents(hwnd, flips - This->flips, copies - This->copies);
+    This->flips = flips;
+    This->copies = copies;
+    if (!streak)
+        return;
+
+    /* copying costs about twice the bandwidth of a flip */
+    if (!This->params.Windowed)
+    {
+        now = SDL_GetTicks();
+        if (!This->copy_warn_ticks || now - This->copy_warn_ticks >= PRESENT_COPY_WARN_MS)
+        {
+            WARN("Fullscreen frames are copied instead of flipped (%u in a row)\n", streak);
+            This->copy_warn_ticks = now ? now : 1;
+        }
+    }
+    else if (This->bypass_fallback && This->bypass_wnd != hwnd &&
+            streak >= PRESENT_BYPASS_STREAK && present_covers_display(hwnd))
+    {
+        TRACE("Window %p is composited, requesting to bypass the compositor\n", hwnd);
+        present_bypass_compositor(This, hwnd, TRUE);
+        This->bypass_wnd = hwnd;
+    }
+}
+
+static void head_frame_init(struct head_frame *frame, struct DRIPresent *present,
+        struct D3DWindowBuffer *buffer, HWND hwnd, XID xid, const RECT *pSourceRect,
+        const RECT *pDestRect, const RGNDATA *pDirtyRegion)
+{
+    unsigned i;
+
+    frame->present = present;
+    frame->buffer = buffer;
+    frame->hwnd = hwnd;
+    frame->xid = xid;
+    frame->has_source_rect = pSourceRect != NULL;
+    if (pSourceRect)
+        frame->source_rect = *pSourceRect;
+    frame->has_dest_rect = pDestRect != NULL;
+    if (pDestRect)
+        frame->dest_rect = *pDestRect;
+    frame->dirty_region = NULL;
+    if (pDirtyRegion && pDirtyRegion->rdh.nCount)
+    {
+        size_t size = sizeof(RGNDATA) + pDirtyRegion->rdh.nCount * sizeof(RECT);
+
+        /* without a copy everything is presented */
+        frame->dirty_region = malloc(size);
+        if (frame->dirty_region)
+        {
+            frame->dirty_region->rdh = pDirtyRegion->rdh;
+            for (i = 0; i < pDirtyRegion->rdh.nCount; ++i)
+                ((RECT *)frame->dirty_region->Buffer)[i] =
+                        ((const RECT *)pDirtyRegion->Buffer)[i];
+        }
+    }
+}
+
+/* target_ust is a time set through d3d9_sdl.h or the common vblank of a sync group */
+static BOOL present_submit_at(struct DRIPresent *This, struct D3DWindowBuffer *buffer,
+        HWND hwnd, XID xid, const RECT *pSourceRect, const RECT *pDestRect,
+        const RGNDATA *pDirtyRegion, uint64_t target_ust)
+{
+    const struct dri_backend *dri_backend = This->dri_backend;
+    uint64_t ust;
+    BOOL ok;
+
+    if (target_ust)
+    {
+        PRESENTSetTargetUst(This->present_priv, target_ust);
+        This->timed = TRUE;
+    }
+
+    /* the rects are in back buffer coordinates, the scaled pixmap is presented whole */
+    if (This->backend_scaling)
+    {
+        pSourceRect = NULL;
+        pDestRect = NULL;
+        pDirtyRegion = NULL;
+    }
+
+    /* FIMXE: Do we need to aquire present mutex here? */
+    dri_backend->funcs->present_pixmap(dri_backend->priv, buffer->priv,
+            pSourceRect, pDirtyRegion);
+
+    ok = PRESENTPixmap(xid, buffer->present_pixmap_priv,
+            This->present_interval, This->present_async, This->present_swapeffectcopy,
+            pSourceRect, pDestRect, pDirtyRegion);
+
+    while (This->timed && PRESENTGetTimedComplete(This->present_priv, &target_ust, &ust))
+        sync_report_present(hwnd, target_ust, ust);
+
+    present_count_flips(This, hwnd);
+
+    return ok;
+}
+
+static void present_sync_submit(struct sync_frame *sync, uint64_t target_ust)
+{
+    struct sync_present *frame = (struct sync_present *)sync;
+    struct head_frame *head = &frame->head;
+
+    if (!present_submit_at(head->present, head->buffer, head->hwnd, head->xid,
+            head->has_source_rect ? &head->source_rect : NULL,
+            head->has_dest_rect ? &head->dest_rect : NULL,
+            head->dirty_region, target_ust))
+        ERR("Present of sync group member %p failed\n", head->hwnd);
+
+    free(head->dirty_region);
+    free(frame);
+}
+
+static BOOL present_submit(struct DRIPresent *This, struct D3DWindowBuffer *buffer,
+        HWND hwnd, XID xid, const RECT *pSourceRect, const RECT *pDestRect,
+        const RGNDATA *pDirtyRegion)
+{
+    const struct dri_backend *dri_backend = This->dri_backend;
+    struct sync_present *frame;
+    uint64_t target_ust;
+
+    if (!This->present_priv)
+        return dri_backend->funcs->present_buffer(dri_backend->priv, buffer->priv,
+                This->present_interval);
+
+    if (!sync_begin_present(hwnd, &target_ust))
+        return present_submit_at(This, buffer, hwnd, xid, pSourceRect, pDestRect,
+                pDirtyRegion, target_ust);
+
+    /* held until every member of the sync group has a frame, without a copy
+     * the frame is presented right away */
+    frame = malloc(sizeof(*frame));
+    if (!frame)
+        return present_submit_at(This, buffer, hwnd, xid, pSourceRect, pDestRect,
+                pDirtyRegion, target_ust);
+
+    head_frame_init(&frame->head, This, buffer, hwnd, xid, pSourceRect, pDestRect,
+            pDirtyRegion);
+    frame->sync.hwnd = hwnd;
+    frame->sync.owner = This;
+    frame->sync.data = buffer;
+    frame->sync.next_ust = target_ust ? target_ust :
+            PRESENTGetNextVblankUst(This->present_priv, This->present_interval);
+    frame->sync.submit = present_sync_submit;
+
+    /* unless it left the group in between */
+    if (!sync_queue_frame(&frame->sync))
+        present_sync_submit(&frame->sync, target_ust);
+
+    return TRUE;
+}
+
+/* must be called with heads_mutex held */
+static BOOL present_group_flush(struct DRIPresentGroup *group)
+{
+    BOOL ok = TRUE;
+    unsigned i;
+
+    /* submitted back to back, so every head flips on its next vblank */
+    for (i = 0; i < group->nframes; ++i)
+    {
+        struct head_frame *frame = &group->frames[i];
+
+        if (!present_submit(frame->present, frame->buffer, frame->hwnd, frame->xid,
+                frame->has_source_rect ? &frame->source_rect : NULL,
+                frame->has_dest_rect ? &frame->dest_rect : NULL,
+                frame->dirty_region))
+        {
+            ERR("Present of head %d failed\n", frame->present->display);
+            ok = FALSE;
+        }
+        free(frame->dirty_region);
+    }
+    group->nframes = 0;
+
+    return ok;
+}
+
+static BOOL present_group_queue(struct DRIPresentGroup *group, struct DRIPresent *present,
+        struct D3DWindowBuffer *buffer, HWND hwnd, XID xid, const RECT *pSourceRect,
+        const RECT *pDestRect, const RGNDATA *pDirtyRegion)
+{
+    struct head_frame *frame;
+    BOOL ok = TRUE;
+    unsigned i;
+
+    SDL_LockMutex(group->heads_mutex);
+
+    /* a head presenting again, e.g. through IDirect3DSwapChain9::Present,
+     * doesn't wait for the others */
+    for (i = 0; i < group->nframes; ++i)
+    {
+        if (group->frames[i].present == present)
+        {
+            ok = present_group_flush(group);
+            break;
+        }
+    }
+
+    frame = &group->frames[group->nframes++];
+    head_frame_init(frame, present, buffer, hwnd, xid, pSourceRect, pDestRect, pDirtyRegion);
+
+    if (group->nframes == group->npresent_backends)
+        ok = present_group_flush(group) && ok;
+
+    SDL_UnlockMutex(group->heads_mutex);
+
+    return ok;
+}
+
+/* Submits the queued frames if one of present shows buffer, or any buffer
+ * if it's NULL. Queued buffers aren't released until they are submitted and
+ * must not be rendered to or freed in between. */
+static void present_group_flush_buffer(struct DRIPresentGroup *group, struct DRIPresent *present,
+        struct D3DWindowBuffer *buffer)
+{
+    unsigned i;
+
+    SDL_LockMutex(group->heads_mutex);
+    for (i = 0; i < group->nframes; ++i)
+    {
+        if (group->frames[i].present == present &&
+            (!buffer || group->frames[i].buffer == buffer))
+        {
+            present_group_flush(group);
+            break;
+        }
+    }
+    SDL_UnlockMutex(group->heads_mutex);
+}
+
+static BOOL present_group_has_buffer(struct DRIPresentGroup *group, struct DRIPresent *present,
+        struct D3DWindowBuffer *buffer)
+{
+    BOOL ret = FALSE;
+    unsigned i;
+
+    SDL_LockMutex(group->heads_mutex);
+    for (i = 0; i < group->nframes && !ret; ++i)
+        ret = group->frames[i].present == present && group->frames[i].buffer == buffer;
+    SDL_UnlockMutex(group->heads_mutex);
+
+    return ret;
+}
+
+/* forget the queued frames of a head that goes away */
+static void present_group_drop_frames(struct DRIPresentGroup *group, struct DRIPresent *present)
+{
+    unsigned i, j;
+
+    SDL_LockMutex(group->heads_mutex);
+    for (i = j = 0; i < group->nframes; ++i)
+    {
+        if (group->frames[i].present == present)
+            free(group->frames[i].dirty_region);
+        else
+            group->frames[j++] = group->frames[i];
+    }
+    group->nframes = j;
+    SDL_UnlockMutex(group->heads_mutex);
+}
+
 /* ID3DPresentVtbl */
 
 static ULONG WINAPI DRIPresent_AddRef(struct DRIPresent *This)
@@ -234,9 +674,19 @@ static ULONG WINAPI DRIPresent_Release(struct DRIPresent *This)
     if (refs == 0)
     {
         /* dtor */
+        if (This->group)
+            present_group_drop_frames(This->group, This);
         SDL_SetWindowFullscreen(This->params.hDeviceWindow, 0);
+        display_invalidate();
         SDL_FreeCursor(This->hCursor);
-        PRESENTDestroy(This->present_priv);
+        present_restore_compositor(This);
+        window_release(This->tracked_wnd);
+        sync_flush_frames(This);
+        sync_remove_window(This->params.hDeviceWindow);
+        if (This->present_priv)
+            PRESENTDestroy(This->present_priv);
+        if (This->own_wnd)
+            SDL_DestroyWindow(This->own_wnd);
         This->dri_backend->funcs->deinit(This->dri_backend->priv);
         free(This);
     }
@@ -266,6 +716,7 @@ static HRESULT WINAPI DRIPresent_QueryInterface(struct DRIPresent *This,
 static HRESULT WINAPI DRIPresent_SetPresentParameters(struct DRIPresent *This,
         D3DPRESENT_PARAMETERS *params, D3DDISPLAYMODEEX *pFullscreenDisplayMode)
 {
+    Uint32 fullscreen;
     int w, h;
 
     TRACE("This=%p, params=%p, focus_window=%p, params->hDeviceWindow=%p\n",
@@ -282,6 +733,13 @@ static HRESULT WINAPI DRIPresent_SetPresentParameters(struct DRIPresent *This,
     else
         This->params.hDeviceWindow = params->hDeviceWindow;
 
+    if (This->tracked_wnd != params->hDeviceWindow)
+    {
+        window_release(This->tracked_wnd);
+        This->tracked_wnd = window_acquire(params->hDeviceWindow) ?
+                params->hDeviceWindow : NULL;
+    }
+
     if (pFullscreenDisplayMode)
     {
         SDL_DisplayMode mode = {
@@ -290,12 +748,9 @@ static HRESULT WINAPI DRIPresent_SetPresentParameters(struct DRIPresent *This,
             pFullscreenDisplayMode->Height,
             pFullscreenDisplayMode->RefreshRate
         };
-        
-        if (SDL_SetWindowDisplayMode(params->hDeviceWindow, &mode) < 0)
-        {
-            ERR("Failed to set window display mode with error %s\n", SDL_GetError());
+
+        if (!set_window_display_mode(This, params->hDeviceWindow, &mode))
             return D3DERR_DRIVERINTERNALERROR;
-        }
     }
     else if (!This->ex)
     {
@@ -305,18 +760,26 @@ static HRESULT WINAPI DRIPresent_SetPresentParameters(struct DRIPresent *This,
             params->BackBufferHeight,
             params->FullScreen_RefreshRateInHz
         };
-        
-        if (SDL_SetWindowDisplayMode(params->hDeviceWindow, &mode) < 0)
-        {
-            ERR("Failed to set window display mode with error %s\n", SDL_GetError());
+
+        if (!set_window_display_mode(This, params->hDeviceWindow, &mode))
             return D3DERR_DRIVERINTERNALERROR;
-        }
     }
 
-    if (SDL_SetWindowFullscreen(params->hDeviceWindow, params->Windowed ? 0 : SDL_WINDOW_FULLSCREEN) < 0)
+    if (params->Windowed)
+        fullscreen = 0;
+    else if (This->fullscreen_desktop)
+        fullscreen = SDL_WINDOW_FULLSCREEN_DESKTOP;
+    else
+        fullscreen = SDL_WINDOW_FULLSCREEN;
+    if ((SDL_GetWindowFlags(params->hDeviceWindow) & SDL_WINDOW_FULLSCREEN_DESKTOP) != fullscreen)
     {
-        ERR("Failed to switch window to fullscreen with error %s\n", SDL_GetError());
-        return D3DERR_DRIVERINTERNALERROR;
+        if (SDL_SetWindowFullscreen(params->hDeviceWindow, fullscreen) < 0)
+        {
+            ERR("Failed to switch window to fullscreen with error %s\n", SDL_GetError());
+            return D3DERR_DRIVERINTERNALERROR;
+        }
+        window_update_size(params->hDeviceWindow);
+        display_invalidate();
     }
 
     if (!params->BackBufferWidth || !params->BackBufferHeight) {
@@ -333,7 +796,12 @@ static HRESULT WINAPI DRIPresent_SetPresentParameters(struct DRIPresent *This,
     }
     else if (params->Windowed && !This->no_window_changes)
     {
-        SDL_SetWindowSize(params->hDeviceWindow, params->BackBufferWidth, params->BackBufferHeight);
+        SDL_GetWindowSize(params->hDeviceWindow, &w, &h);
+        if (w != params->BackBufferWidth || h != params->BackBufferHeight)
+        {
+            SDL_SetWindowSize(params->hDeviceWindow, params->BackBufferWidth, params->BackBufferHeight);
+            window_update_size(params->hDeviceWindow);
+        }
     }
 
     /* Set as last in case of failed reset those aren't updated */
@@ -341,7 +809,9 @@ static HRESULT WINAPI DRIPresent_SetPresentParameters(struct DRIPresent *This,
 
     update_presentation_interval(This);
 
-    if (!params->Windowed)
+    This->vrr = FALSE;
+
+    if (!params->Windowed && !This->dri_backend->funcs->present_buffer)
     {
         SDL_SysWMinfo wm;
         SDL_VERSION(&wm.version);
@@ -352,29 +822,54 @@ static HRESULT WINAPI DRIPresent_SetPresentParameters(struct DRIPresent *This,
         }
         
         if (wm.subsystem != SDL_SYSWM_X11)
+        {
+            update_vrr(This);
             return D3D_OK;
+        }
 
-        Atom _NET_WM_BYPASS_COMPOSITOR = XInternAtom(wm.info.x11.display,
-                                                     "_NET_WM_BYPASS_COMPOSITOR",
-                                                     False);
+        /* The properties stay on the window, set them only once */
+        if (This->fullscreen_props_window != wm.info.x11.window)
+        {
+            if (!This->atom_bypass_compositor)
+                This->atom_bypass_compositor = XInternAtom(wm.info.x11.display,
+                                                           "_NET_WM_BYPASS_COMPOSITOR",
+                                                           False);
+            if (!This->atom_variable_refresh)
+                This->atom_variable_refresh = XInternAtom(wm.info.x11.display,
+                                                          "_VARIABLE_REFRESH",
+                                                          False);
+
+            /* Disable compositing for fullscreen windows */
+            int bypass_value = 1;
+            XChangeProperty(wm.info.x11.display, wm.info.x11.window,
+                            This->atom_bypass_compositor, XA_CARDINAL, 32,
+                            PropModeReplace, (unsigned char *)&bypass_value, 1);
+
+            /* Enable variable sync */
+            int vrr_value = 1;
+            XChangeProperty(wm.info.x11.display, wm.info.x11.window,
+                            This->atom_variable_refresh, XA_CARDINAL, 32,
+                            PropModeReplace, (unsigned char *)&vrr_value, 1);
+
+            This->fullscreen_props_window = wm.info.x11.window;
+        }
 
-        Atom _VARIABLE_REFRESH = XInternAtom(wm.info.x11.display,
-                                             "_VARIABLE_REFRESH",
-                                             False);
+        if (present_getenv_bool("D3D_VRR"))
+        {
+            SDL_DisplayMode dm;
 
-        /* Disable compositing for fullscreen windows */
-        int bypass_value = 1;
-        XChangeProperty(wm.info.x11.display, wm.info.x11.window,
-                        _NET_WM_BYPASS_COMPOSITOR, XA_CARDINAL, 32,
-                        PropModeReplace, (unsigned char *)&bypass_value, 1);
+            ZeroMemory(&dm, sizeof(dm));
+            SDL_GetWindowDisplayMode(params->hDeviceWindow, &dm);
 
-        /* Enable variable sync */
-        int vrr_value = 1;
-        XChangeProperty(wm.info.x11.display, wm.info.x11.window,
-                        _VARIABLE_REFRESH, XA_CARDINAL, 32,
-                        PropModeReplace, (unsigned char *)&vrr_value, 1);
+            /* SDL doesn't know the panel's range, the maximum is the mode's refresh rate */
+            This->vrr = TRUE;
+            This->vrr_min_hz = present_getenv_int("D3D_VRR_MIN_HZ", 48);
+            This->vrr_max_hz = dm.refresh_rate ? dm.refresh_rate : 60;
+        }
     }
 
+    update_vrr(This);
+
     return D3D_OK;
 }
 
@@ -383,18 +878,40 @@ static HRESULT WINAPI DRIPresent_D3DWindowBufferFromDmaBuf(struct DRIPresent *Th
         int bpp, struct D3DWindowBuffer **out)
 {
     const struct dri_backend *dri_backend = This->dri_backend;
+    HWND draw_window = This->params.hDeviceWindow ?
+        This->params.hDeviceWindow : This->focus_wnd;
+    int pixmap_width = width, pixmap_height = height;
+    struct window_info info;
+
+    if (This->backend_scaling && window_get_info(draw_window, &info))
+    {
+        pixmap_width = info.width;
+        pixmap_height = info.height;
+    }
 
     if (!dri_backend->funcs->window_buffer_from_dmabuf(dri_backend->priv,
-            This->present_priv, dmaBufFd, width, height, stride, depth, bpp, out))
+            This->present_priv, dmaBufFd, width, height, stride, depth, bpp,
+            pixmap_width, pixmap_height, out))
     {
         ERR("window_buffer_from_dmabuf failed\n");
         return D3DERR_DRIVERINTERNALERROR;
     }
+    (*out)->width = width;
+    (*out)->height = height;
 
     //TRACE("This=%p buffer=%p\n", This, *out);
     return D3D_OK;
 }
 
+/* the backend may still read the buffer after PRESENT released the pixmap */
+static void present_wait_buffer_idle(struct DRIPresent *This, struct D3DWindowBuffer *buffer)
+{
+    const struct dri_backend *dri_backend = This->dri_backend;
+
+    if (dri_backend->funcs->wait_buffer_idle)
+        dri_backend->funcs->wait_buffer_idle(dri_backend->priv, buffer->priv);
+}
+
 static HRESULT WINAPI DRIPresent_DestroyD3DWindowBuffer(struct DRIPresent *This,
         struct D3DWindowBuffer *buffer)
 {
@@ -404,7 +921,12 @@ static HRESULT WINAPI DRIPresent_DestroyD3DWindowBuffer(struct DRIPresent *This,
      * But if it can delete it right away, we may have
      * better performance */
     //TRACE("This=%p buffer=%p of priv %p\n", This, buffer, buffer->present_pixmap_priv);
-    PRESENTTryFreePixmap(buffer->present_pixmap_priv);
+    if (This->group)
+        present_group_flush_buffer(This->group, This, buffer);
+    if (sync_is_held(This, buffer))
+        sync_flush_frames(This);
+    if (buffer->present_pixmap_priv)
+        PRESENTTryFreePixmap(buffer->present_pixmap_priv);
     dri_backend->funcs->destroy_pixmap(dri_backend->priv, buffer->priv);
     free(buffer);
     return D3D_OK;
@@ -414,11 +936,22 @@ static HRESULT WINAPI DRIPresent_WaitBufferReleased(struct DRIPresent *This,
         struct D3DWindowBuffer *buffer)
 {
     //TRACE("This=%p buffer=%p\n", This, buffer);
+    /* it would never be released while it's queued or held */
+    if (This->group)
+        present_group_flush_buffer(This->group, This, buffer);
+
+    if (!buffer->present_pixmap_priv) /* headless, released after presenting */
+        return D3D_OK;
+
+    if (sync_is_held(This, buffer))
+        sync_flush_frames(This);
+
     if(!PRESENTWaitPixmapReleased(buffer->present_pixmap_priv))
     {
         ERR("PRESENTWaitPixmapReleased failed\n");
         return D3DERR_DRIVERINTERNALERROR;
     }
+    present_wait_buffer_idle(This, buffer);
     return D3D_OK;
 }
 
@@ -433,13 +966,39 @@ static HRESULT WINAPI DRIPresent_FrontBufferCopy(struct DRIPresent *This,
     return D3D_OK;
 }
 
+static void scale_rect(RECT *rect, const RECT *src, int src_width, int src_height,
+        int dst_width, int dst_height)
+{
+    rect->left = src->left * dst_width / src_width;
+    rect->top = src->top * dst_height / src_height;
+    rect->right = src->right * dst_width / src_width;
+    rect->bottom = src->bottom * dst_height / src_height;
+}
+
+static void throttle_background(struct DRIPresent *This, HWND hwnd)
+{
+    Uint64 now = SDL_GetPerformanceCounter();
+    Uint64 freq = SDL_GetPerformanceFrequency();
+    Uint64 period = freq / This->background_fps;
+
+    if (This->last_present && now - This->last_present < period &&
+            !window_has_focus(hwnd))
+    {
+        SDL_Delay((period - (now - This->last_present)) * 1000 / freq);
+        now = SDL_GetPerformanceCounter();
+    }
+    This->last_present = now;
+}
+
 static HRESULT WINAPI DRIPresent_PresentBuffer( struct DRIPresent *This,
         struct D3DWindowBuffer *buffer, HWND hWndOverride, const RECT *pSourceRect,
         const RECT *pDestRect, const RGNDATA *pDirtyRegion, DWORD Flags )
 {
-    const struct dri_backend *dri_backend = This->dri_backend;
     HWND hwnd;
-    SDL_SysWMinfo wm;
+    struct window_info info;
+    RECT source_rect;
+    RGNDATA *dirty_region = NULL;
+    BOOL ok;
 
     if (hWndOverride)
         hwnd = hWndOverride;
@@ -450,22 +1009,78 @@ static HRESULT WINAPI DRIPresent_PresentBuffer( struct DRIPresent *This,
 
     //TRACE("This=%p hwnd=%p\n", This, hwnd);
 
-    SDL_VERSION(&wm.version);
-    if (!SDL_GetWindowWMInfo(hwnd, &wm))
+    if (!This->present_priv)
+        info.xid = 0; /* headless */
+    else if (!window_get_info(hwnd, &info))
         return D3DERR_DRIVERINTERNALERROR;
-
-    if (!PRESENTPixmapPrepare(wm.info.x11.window, buffer->present_pixmap_priv))
+    else if (!PRESENTPixmapPrepare(info.xid, buffer->present_pixmap_priv))
     {
         ERR("PresentPrepare call failed\n");
         return D3DERR_DRIVERINTERNALERROR;
     }
 
-    /* FIMXE: Do we need to aquire present mutex here? */
-    dri_backend->funcs->present_pixmap(dri_backend->priv, buffer->priv);
+    /* When the window size doesn't match the back buffer, e.g. with desktop
+     * fullscreen, Nine scales into window sized buffers. The rects are
+     * still in back buffer coordinates then. */
+    if ((pSourceRect || pDirtyRegion) && This->params.BackBufferWidth &&
+            This->params.BackBufferHeight && buffer->width && buffer->height &&
+            (buffer->width != This->params.BackBufferWidth ||
+             buffer->height != This->params.BackBufferHeight))
+    {
+        if (pSourceRect)
+        {
+            scale_rect(&source_rect, pSourceRect,
+                    This->params.BackBufferWidth, This->params.BackBufferHeight,
+                    buffer->width, buffer->height);
+            pSourceRect = &source_rect;
+        }
 
-    if (!PRESENTPixmap(wm.info.x11.window, buffer->present_pixmap_priv,
-            This->present_interval, This->present_async, This->present_swapeffectcopy,
-            pSourceRect, pDestRect, pDirtyRegion))
+        if (pDirtyRegion && pDirtyRegion->rdh.nCount)
+        {
+            dirty_region = malloc(sizeof(RGNDATA) + pDirtyRegion->rdh.nCount * sizeof(RECT));
+            if (dirty_region)
+            {
+                const RECT *src = (const RECT *)pDirtyRegion->Buffer;
+                RECT *dst = (RECT *)dirty_region->Buffer;
+                RECT *bound = &dirty_region->rdh.rcBound;
+                unsigned i;
+
+                dirty_region->rdh = pDirtyRegion->rdh;
+                for (i = 0; i < pDirtyRegion->rdh.nCount; i++)
+                {
+                    scale_rect(&dst[i], &src[i],
+                            This->params.BackBufferWidth, This->params.BackBufferHeight,
+                            buffer->width, buffer->height);
+
+                    /* apps don't always fill rcBound, compute it from the rects */
+                    if (!i)
+                        *bound = dst[i];
+                    else
+                    {
+                        bound->left = SDL_min(bound->left, dst[i].left);
+                        bound->top = SDL_min(bound->top, dst[i].top);
+                        bound->right = SDL_max(bound->right, dst[i].right);
+                        bound->bottom = SDL_max(bound->bottom, dst[i].bottom);
+                    }
+                }
+                pDirtyRegion = dirty_region;
+            }
+            else
+                pDirtyRegion = NULL; /* present everything */
+        }
+    }
+
+    if (This->background_fps)
+        throttle_background(This, hwnd);
+
+    if (This->group)
+        ok = present_group_queue(This->group, This, buffer, hwnd, info.xid,
+                pSourceRect, pDestRect, pDirtyRegion);
+    else
+        ok = present_submit(This, buffer, hwnd, info.xid, pSourceRect, pDestRect, pDirtyRegion);
+    free(dirty_region);
+
+    if (!ok)
     {
         TRACE("Present call failed\n");
         return D3DERR_DRIVERINTERNALERROR;
@@ -487,7 +1102,7 @@ static HRESULT WINAPI DRIPresent_GetRasterStatus( struct DRIPresent *This,
 
     SDL_DisplayMode dm;
     ZeroMemory(&dm, sizeof(dm));
-    if (SDL_GetWindowDisplayMode(This->params.hDeviceWindow, &dm) < 0)
+    if (!display_get_current_mode(SDL_GetWindowDisplayIndex(This->params.hDeviceWindow), &dm))
         return D3DERR_INVALIDCALL;
 
     if (dm.refresh_rate == 0)
@@ -520,13 +1135,24 @@ static HRESULT WINAPI DRIPresent_GetDisplayMode( struct DRIPresent *This,
 
     ZeroMemory(&dm, sizeof(dm));
 
-    SDL_GetWindowDisplayMode(This->params.hDeviceWindow, &dm);
+    display_get_current_mode(SDL_GetWindowDisplayIndex(This->params.hDeviceWindow), &dm);
     pMode->Width = dm.w;
     pMode->Height = dm.h;
     pMode->RefreshRate = dm.refresh_rate;
     pMode->ScanLineOrdering = D3DSCANLINEORDERING_PROGRESSIVE;
     pMode->Format = to_d3d_format(dm.format);
 
+    /* desktop fullscreen reports the mode the application asked for */
+    if (This->fullscreen_desktop && !This->params.Windowed)
+    {
+        pMode->Width = This->params.BackBufferWidth;
+        pMode->Height = This->params.BackBufferHeight;
+        if (This->params.FullScreen_RefreshRateInHz)
+            pMode->RefreshRate = This->params.FullScreen_RefreshRateInHz;
+        if (This->params.BackBufferFormat != D3DFMT_UNKNOWN)
+            pMode->Format = This->params.BackBufferFormat;
+    }
+
     *pRotation = D3DDISPLAYROTATION_IDENTITY;
     return D3D_OK;
 }
@@ -633,18 +1259,41 @@ static HRESULT WINAPI DRIPresent_GetWindowInfo( struct DRIPresent *This,
 {
     HWND draw_window = This->params.hDeviceWindow ?
         This->params.hDeviceWindow : This->focus_wnd;
+    struct window_info info;
 
     if (!hWnd)
         hWnd = draw_window;
+
+    if (window_get_info(hWnd, &info))
+    {
+        *width = info.width;
+        *height = info.height;
+        *depth = info.depth;
+
+        /* Nine then renders at back buffer size without scaling itself */
+        if (This->backend_scaling && hWnd == draw_window)
+        {
+            *width = This->params.BackBufferWidth;
+            *height = This->params.BackBufferHeight;
+        }
+        return D3D_OK;
+    }
+
+    /* not on X11 */
     SDL_GetWindowSize(hWnd, width, height);
-    *depth = 24; //TODO
+    *depth = 24;
     return D3D_OK;
 }
 
 #if D3DADAPTER_DRIVER_PRESENT_VERSION_MINOR >= 1
 static BOOL WINAPI DRIPresent_GetWindowOccluded(struct DRIPresent *This)
 {
-    return This->focus_wnd && SDL_GetWindowFlags(This->focus_wnd) & SDL_WINDOW_MINIMIZED;
+    HWND draw_window = This->params.hDeviceWindow ?
+        This->params.hDeviceWindow : This->focus_wnd;
+
+    /* Nine turns occlusion into a lost device for non-Ex devices, which
+     * Windows doesn't do for windowed ones that are merely covered */
+    return window_is_occluded(draw_window, This->ex || !This->params.Windowed);
 }
 #endif
 
@@ -655,11 +1304,12 @@ static BOOL WINAPI DRIPresent_ResolutionMismatch(struct DRIPresent *This)
      * Poll this function to get the device's resolution match.
      * A device reset is required to restore the requested resolution.
      */
-    if (This->ex || This->params.Windowed || !This->params.hDeviceWindow)
+    if (This->ex || This->params.Windowed || !This->params.hDeviceWindow ||
+            This->fullscreen_desktop)
         return FALSE;
     
     SDL_DisplayMode mode;
-    if (SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(This->params.hDeviceWindow), &mode) < 0)
+    if (!display_get_current_mode(SDL_GetWindowDisplayIndex(This->params.hDeviceWindow), &mode))
         return FALSE;
     return mode.w != This->params.BackBufferWidth || mode.h != This->params.BackBufferHeight;
 }
@@ -688,12 +1338,27 @@ static HRESULT WINAPI DRIPresent_SetPresentParameters2( struct DRIPresent *This,
 static BOOL WINAPI DRIPresent_IsBufferReleased( struct DRIPresent *This, struct D3DWindowBuffer *buffer )
 {
     //TRACE("This=%p buffer=%p\n", This, buffer);
-    return PRESENTIsPixmapReleased(buffer->present_pixmap_priv);
+    if (This->group && present_group_has_buffer(This->group, This, buffer))
+        return FALSE;
+    if (!buffer->present_pixmap_priv)
+        return TRUE;
+    if (sync_is_held(This, buffer))
+        return FALSE;
+    if (!PRESENTIsPixmapReleased(buffer->present_pixmap_priv))
+        return FALSE;
+    /* the server is done with it, the GPU almost certainly too */
+    present_wait_buffer_idle(This, buffer);
+    return TRUE;
 }
 
 static HRESULT WINAPI DRIPresent_WaitBufferReleaseEvent( struct DRIPresent *This )
 {
-    PRESENTWaitReleaseEvent(This->present_priv);
+    /* Nine waits for a buffer, a queued or held one would never be released */
+    if (This->group)
+        present_group_flush_buffer(This->group, This, NULL);
+    sync_flush_frames(This);
+    if (This->present_priv)
+        PRESENTWaitReleaseEvent(This->present_priv);
     return D3D_OK;
 }
 #endif
@@ -731,13 +1396,41 @@ static ID3DPresentVtbl DRIPresent_vtable = {
 #endif
 };
 
+/* a borderless window covering the display of a head */
+static HWND present_create_head_window(int display, const D3DPRESENT_PARAMETERS *params)
+{
+    SDL_Rect bounds = { 0, 0, 640, 480 };
+    HWND hwnd;
+
+    SDL_GetDisplayBounds(display, &bounds);
+    hwnd = SDL_CreateWindow("", SDL_WINDOWPOS_CENTERED_DISPLAY(display),
+            SDL_WINDOWPOS_CENTERED_DISPLAY(display),
+            params->BackBufferWidth ? params->BackBufferWidth : bounds.w,
+            params->BackBufferHeight ? params->BackBufferHeight : bounds.h,
+            SDL_WINDOW_BORDERLESS);
+    if (!hwnd)
+        ERR("Failed to create window for display %d with error %s\n", display, SDL_GetError());
+
+    return hwnd;
+}
+
 static HRESULT present_create(Display *gdi_display, HWND focus_wnd, D3DPRESENT_PARAMETERS *params,
-        D3DDISPLAYMODEEX *pFullscreenDisplayMode, struct DRIPresent **out,
-        BOOL ex, BOOL no_window_changes, struct dri_backend *dri_backend, int major, int minor)
+        D3DDISPLAYMODEEX *pFullscreenDisplayMode, int display, BOOL head_window,
+        struct DRIPresent **out, BOOL ex, BOOL no_window_changes,
+        struct dri_backend *dri_backend, int major, int minor)
 {
     struct DRIPresent *This;
     HRESULT hr;
 
+    if (head_window && !params->hDeviceWindow && display >= 0)
+    {
+        params->hDeviceWindow = present_create_head_window(display, params);
+        if (!params->hDeviceWindow)
+            return D3DERR_DRIVERINTERNALERROR;
+    }
+    else
+        head_window = FALSE;
+
     if (!focus_wnd && !params->hDeviceWindow)
     {
         ERR("No focus HWND specified for presentation backend.\n");
@@ -753,26 +1446,53 @@ static HRESULT present_create(Display *gdi_display, HWND focus_wnd, D3DPRESENT_P
 
     This->vtable = &DRIPresent_vtable;
     This->refs = 1;
+    This->display = display;
+    if (head_window)
+        This->own_wnd = params->hDeviceWindow;
     This->major = major;
     This->minor = minor;
     This->focus_wnd = focus_wnd;
     This->ex = ex;
     This->no_window_changes = no_window_changes;
+    This->fullscreen_desktop = present_getenv_bool("D3D_FULLSCREEN_DESKTOP");
+    This->background_fps = present_getenv_int("D3D_BACKGROUND_FPS", 0);
+    if (This->background_fps < 0)
+        This->background_fps = 0;
     This->dri_backend = dri_backend;
+    This->backend_scaling = dri_backend->funcs->can_scale &&
+            present_getenv_bool("D3D_DRI2_SCALE");
+    This->bypass_fallback = present_getenv_bool("D3D_BYPASS_COMPOSITOR");
 
     if (!params->hDeviceWindow)
         params->hDeviceWindow = This->focus_wnd;
 
+    /* fullscreen covers the display the window is on, move it to the head's one */
+    if (display >= 0 && !params->Windowed && !no_window_changes &&
+            SDL_GetWindowDisplayIndex(params->hDeviceWindow) != display)
+    {
+        SDL_SetWindowPosition(params->hDeviceWindow, SDL_WINDOWPOS_CENTERED_DISPLAY(display),
+                SDL_WINDOWPOS_CENTERED_DISPLAY(display));
+    }
+
     hr = DRIPresent_SetPresentParameters(This, params, pFullscreenDisplayMode);
     if (FAILED(hr))
         return hr;
 
-    if (!PRESENTInit(gdi_display, &(This->present_priv)))
+    /* the headless backend presents by itself */
+    if (!dri_backend->funcs->present_buffer &&
+            !PRESENTInit(gdi_display, &(This->present_priv)))
     {
         ERR("Failed to init Present backend\n");
         return D3DERR_DRIVERINTERNALERROR;
     }
 
+    if (This->present_priv && present_getenv_bool("D3D_ADAPTIVE_VSYNC"))
+    {
+        TRACE("Adaptive vsync enabled\n");
+        PRESENTSetAdaptiveSync(This->present_priv, TRUE);
+    }
+    update_vrr(This);
+
     if (!dri_backend->funcs->init(dri_backend->priv))
     {
         free(This);
@@ -805,10 +1525,18 @@ static ULONG WINAPI DRIPresentGroup_Release(struct DRIPresentGroup *This)
             for (i = 0; i < This->npresent_backends; ++i)
             {
                 if (This->present_backends[i])
+                {
+                    /* the heads might outlive the group */
+                    present_group_drop_frames(This, This->present_backends[i]);
+                    This->present_backends[i]->group = NULL;
                     DRIPresent_Release(This->present_backends[i]);
+                }
             }
             free(This->present_backends);
         }
+        free(This->frames);
+        if (This->heads_mutex)
+            SDL_DestroyMutex(This->heads_mutex);
         free(This);
     }
     return refs;
@@ -835,8 +1563,7 @@ static HRESULT WINAPI DRIPresentGroup_QueryInterface(struct DRIPresentGroup *Thi
 
 static UINT WINAPI DRIPresentGroup_GetMultiheadCount(struct DRIPresentGroup *This)
 {
-    FIXME("(%p), stub!\n", This);
-    return 1;
+    return This->npresent_backends;
 }
 
 static HRESULT WINAPI DRIPresentGroup_GetPresent(struct DRIPresentGroup *This,
@@ -857,7 +1584,7 @@ static HRESULT WINAPI DRIPresentGroup_CreateAdditionalPresent(struct DRIPresentG
         D3DPRESENT_PARAMETERS *pPresentationParameters, ID3DPresent **ppPresent)
 {
     HRESULT hr;
-    hr = present_create(This->gdi_display, 0, pPresentationParameters, NULL,
+    hr = present_create(This->gdi_display, 0, pPresentationParameters, NULL, -1, FALSE,
             (struct DRIPresent **)ppPresent, This->ex, This->no_window_changes,
             This->dri_backend, This->major, This->minor);
 
@@ -883,8 +1610,8 @@ static ID3DPresentGroupVtbl DRIPresentGroup_vtable = {
 
 HRESULT present_create_present_group(Display *gdi_display, HWND focus_wnd,
         D3DPRESENT_PARAMETERS *params, D3DDISPLAYMODEEX *pFullscreenDisplayMode,
-        unsigned nparams, ID3DPresentGroup **group, BOOL ex, DWORD BehaviorFlags,
-        struct dri_backend *dri_backend)
+        const int *displays, unsigned nparams, ID3DPresentGroup **group, BOOL ex,
+        DWORD BehaviorFlags, struct dri_backend *dri_backend)
 {
     struct DRIPresentGroup *This;
     HRESULT hr;
@@ -924,11 +1651,25 @@ HRESULT present_create_present_group(Display *gdi_display, HWND focus_wnd,
         return E_OUTOFMEMORY;
     }
 
+    if (This->npresent_backends > 1)
+    {
+        This->heads_mutex = SDL_CreateMutex();
+        This->frames = calloc(This->npresent_backends, sizeof(struct head_frame));
+        if (!This->heads_mutex || !This->frames)
+        {
+            DRIPresentGroup_Release(This);
+            ERR("Out of memory.\n");
+            return E_OUTOFMEMORY;
+        }
+    }
+
     for (i = 0; i < This->npresent_backends; ++i)
     {
-        /* create an ID3DPresent for it */
+        /* create an ID3DPresent for it, heads other than the first
+         * one get their own window if the application has none */
         hr = present_create(gdi_display, focus_wnd, &params[i],
                 pFullscreenDisplayMode ? &pFullscreenDisplayMode[i] : NULL,
+                displays ? displays[i] : -1, i > 0,
                 &This->present_backends[i], ex, This->no_window_changes,
                 This->dri_backend, This->major, This->minor);
         if (FAILED(hr))
@@ -936,6 +1677,8 @@ HRESULT present_create_present_group(Display *gdi_display, HWND focus_wnd,
             DRIPresentGroup_Release(This);
             return hr;
         }
+        if (This->npresent_backends > 1)
+            This->present_backends[i]->group = This;
     }
 
     *group = (ID3DPresentGroup *)This;
@@ -973,17 +1716,24 @@ HRESULT present_create_adapter9(struct dri_backend *dri_backend, ID3DAdapter9 **
     return D3D_OK;
 }
 
-BOOL present_has_d3dadapter(Display *gdi_display)
+/* loads d3dadapter9 and binds the drm backend, runs once per process */
+static BOOL present_load_d3dadapter(void)
 {
     static const void * WINAPI (*pD3DAdapter9GetProc)(const char *);
+    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
     static void *handle = NULL;
-    static int done = 0;
+    static BOOL done = FALSE;
     char *pathbuf = NULL;
+    BOOL ret;
 
-    /* like in opengl.c (single threaded assumption OK?) */
+    pthread_mutex_lock(&mutex);
     if (done)
-        return handle != NULL;
-    done = 1;
+    {
+        ret = handle != NULL;
+        pthread_mutex_unlock(&mutex);
+        return ret;
+    }
+    done = TRUE;
 
     handle = common_load_d3dadapter(&pathbuf, NULL);
 
@@ -1011,27 +1761,20 @@ BOOL present_has_d3dadapter(Display *gdi_display)
     {
         ERR("Version mismatch. %s has %u.%u, was expecting 0.x\n",
             pathbuf, d3d9_drm->major_version, d3d9_drm->minor_version);
+        d3d9_drm = NULL;
         goto cleanup;
     }
 
     TRACE("d3dadapter9 version: %u.%u\n",
           d3d9_drm->major_version, d3d9_drm->minor_version);
 
-    if (!PRESENTCheckExtension(gdi_display, 1, 0))
-    {
-        ERR("Unable to query PRESENT.\n");
-        goto cleanup;
-    }
-
-    if (!backend_probe(gdi_display))
-    {
-        ERR("No available backends.\n");
-        goto cleanup;
-    }
+    free(pathbuf);
+    pthread_mutex_unlock(&mutex);
 
     return TRUE;
 
 cleanup:
+    d3d9_drm = NULL;
     if (handle)
     {
         dlclose(handle);
@@ -1039,6 +1782,27 @@ cleanup:
     }
 
     free(pathbuf);
+    pthread_mutex_unlock(&mutex);
 
     return FALSE;
 }
+
+BOOL present_has_d3dadapter(Display *gdi_display)
+{
+    if (!present_load_d3dadapter())
+        return FALSE;
+
+    if (!backend_is_headless() && !PRESENTCheckExtension(gdi_display, 1, 0))
+    {
+        ERR("Unable to query PRESENT.\n");
+        return FALSE;
+    }
+
+    if (!backend_probe(gdi_display))
+    {
+        ERR("No available backends.\n");
+        return FALSE;
+    }
+
+    return TRUE;
+}
@@ -16,8 +16,8 @@ typedef enum _D3DFORMAT D3DFORMAT;
 
 HRESULT present_create_present_group(Display *gdi_display, HWND focus,
         D3DPRESENT_PARAMETERS *params, D3DDISPLAYMODEEX *pFullscreenDisplayMode,
-        unsigned nparams, ID3DPresentGroup **group, BOOL ex, DWORD BehaviorFlags,
-        struct dri_backend *dri_backend);
+        const int *displays, unsigned nparams, ID3DPresentGroup **group, BOOL ex,
+        DWORD BehaviorFlags, struct dri_backend *dri_backend);
 
 HRESULT present_create_adapter9(struct dri_backend *dri_backend, ID3DAdapter9 **adapter);
 
@@ -0,0 +1,439 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Wine D3D9 MIT-SHM backend
+ *
+ * Software fallback for X servers that can't import dma-bufs, e.g. in VMs
+ * where only kms_swrast or vgem exist. Nine renders into dma-bufs of a render
+ * node, which are mapped and copied into MIT-SHM pixmaps by the CPU. Those
+ * are presented through PRESENT like the pixmaps of the other backends.
+ */
+
+#ifdef D3D9NINE_SHM
+
+#include <d3d9types.h>
+#include <sys/ioctl.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <linux/dma-buf.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/shm.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "../common/debug.h"
+#include "backend.h"
+#include "xcb_present.h"
+
+struct shm_priv {
+    Display *dpy;
+    int screen;
+    int fd;
+};
+
+struct shm_buffer {
+    int fd; /* dma-buf */
+    void *map;
+    unsigned int stride;
+    unsigned int height;
+    unsigned int row_size; /* bytes of a row, without padding */
+    xcb_shm_seg_t seg;
+    void *shm;
+    unsigned int shm_stride;
+};
+
+typedef void (*shm_copy_func)(void *dst, const void *src, size_t size);
+
+static void shm_copy_c(void *dst, const void *src, size_t size)
+{
+    memcpy(dst, src, size);
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+/* The dma-buf is usually mapped write-combined, regular loads from it are
+ * uncached. MOVNTDQA reads whole lines through the streaming buffers. */
+__attribute__((target("sse4.1")))
+static void shm_copy_sse41(void *dst, const void *src, size_t size)
+{
+    uint8_t *d = dst;
+    uint8_t *s = (uint8_t *)src;
+    size_t head = (16 - ((uintptr_t)s & 15)) & 15;
+
+    if (head > size)
+        head = size;
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    size -= head;
+
+    for (; size >= 64; size -= 64, s += 64, d += 64)
+    {
+        __m128i a = _mm_stream_load_si128((__m128i *)s);
+        __m128i b = _mm_stream_load_si128((__m128i *)(s + 16));
+        __m128i c = _mm_stream_load_si128((__m128i *)(s + 32));
+        __m128i e = _mm_stream_load_si128((__m128i *)(s + 48));
+
+        _mm_storeu_si128((__m128i *)d, a);
+        _mm_storeu_si128((__m128i *)(d + 16), b);
+        _mm_storeu_si128((__m128i *)(d + 32), c);
+        _mm_storeu_si128((__m128i *)(d + 48), e);
+    }
+    memcpy(d, s, size);
+}
+
+__attribute__((target("avx2")))
+static void shm_copy_avx2(void *dst, const void *src, size_t size)
+{
+    uint8_t *d = dst;
+    uint8_t *s = (uint8_t *)src;
+    size_t head = (32 - ((uintptr_t)s & 31)) & 31;
+
+    if (head > size)
+        head = size;
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    size -= head;
+
+    for (; size >= 128; size -= 128, s += 128, d += 128)
+    {
+        __m256i a = _mm256_stream_load_si256((__m256i *)s);
+        __m256i b = _mm256_stream_load_si256((__m256i *)(s + 32));
+        __m256i c = _mm256_stream_load_si256((__m256i *)(s + 64));
+        __m256i e = _mm256_stream_load_si256((__m256i *)(s + 96));
+
+        _mm256_storeu_si256((__m256i *)d, a);
+        _mm256_storeu_si256((__m256i *)(d + 32), b);
+        _mm256_storeu_si256((__m256i *)(d + 64), c);
+        _mm256_storeu_si256((__m256i *)(d + 96), e);
+    }
+    memcpy(d, s, size);
+}
+#endif
+
+static shm_copy_func shm_copy = shm_copy_c;
+static pthread_once_t shm_copy_once = PTHREAD_ONCE_INIT;
+
+static void shm_init_copy(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        shm_copy = shm_copy_avx2;
+    else if (__builtin_cpu_supports("sse4.1"))
+        shm_copy = shm_copy_sse41;
+#endif
+}
+
+static BOOL shm_probe(Display *dpy)
+{
+    xcb_connection_t *xcb_connection = XGetXCBConnection(dpy);
+    xcb_shm_query_version_reply_t *reply;
+    const xcb_query_extension_reply_t *extension;
+    BOOL ret;
+
+    extension = xcb_get_extension_data(xcb_connection, &xcb_shm_id);
+    if (!(extension && extension->present))
+    {
+        WARN("MIT-SHM extension is not present\n");
+        return FALSE;
+    }
+
+    reply = xcb_shm_query_version_reply(xcb_connection,
+            xcb_shm_query_version(xcb_connection), NULL);
+    if (!reply)
+        return FALSE;
+
+    ret = reply->shared_pixmaps;
+    free(reply);
+
+    if (!ret)
+        WARN("MIT-SHM doesn't support shared pixmaps\n");
+    return ret;
+}
+
+static int shm_enumerate(Display *dpy, int screen, struct dri_device *devices, int max)
+{
+    /* without DRI3 or DRI2 the server can't tell its device */
+    return backend_scan_devices(-1, devices, max);
+}
+
+static BOOL shm_create(Display *dpy, int screen, const struct dri_device *device,
+        struct dri_backend_priv **priv)
+{
+    struct dri_device first;
+    struct shm_priv *p;
+    int fd;
+
+    if (!device)
+    {
+        if (backend_scan_devices(-1, &first, 1) <= 0)
+            return FALSE;
+        device = &first;
+    }
+
+    fd = open(device->node, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+    {
+        ERR("Failed to open %s\n", device->node);
+        return FALSE;
+    }
+
+    p = calloc(1, sizeof(struct shm_priv));
+    if (!p)
+    {
+        close(fd);
+        return FALSE;
+    }
+
+    p->dpy = dpy;
+    p->screen = screen;
+    p->fd = fd;
+
+    pthread_once(&shm_copy_once, shm_init_copy);
+
+    TRACE("Rendering on %s\n", device->node);
+
+    *priv = (struct dri_backend_priv *)p;
+
+    return TRUE;
+}
+
+static void shm_destroy(struct dri_backend_priv *priv)
+{
+    struct shm_priv *p = (struct shm_priv *)priv;
+
+    close(p->fd);
+
+    free(p);
+}
+
+static BOOL shm_init(struct dri_backend_priv *priv)
+{
+    return TRUE;
+}
+
+static void shm_deinit(struct dri_backend_priv *priv)
+{
+}
+
+static int shm_get_fd(struct dri_backend_priv *priv)
+{
+    struct shm_priv *p = (struct shm_priv *)priv;
+
+    return p->fd;
+}
+
+static void shm_free_buffer(xcb_connection_t *xcb_connection, struct shm_buffer *buffer)
+{
+    if (buffer->seg)
+        xcb_shm_detach(xcb_connection, buffer->seg);
+    if (buffer->shm)
+        shmdt(buffer->shm);
+    if (buffer->map)
+        munmap(buffer->map, (size_t)buffer->stride * buffer->height);
+    close(buffer->fd);
+    free(buffer);
+}
+
+static BOOL shm_window_buffer_from_dmabuf(struct dri_backend_priv *priv,
+    PRESENTpriv *present_priv, int fd, int width, int height,
+    int stride, int depth, int bpp, int pixmap_width, int pixmap_height,
+    struct D3DWindowBuffer **out)
+{
+    struct shm_priv *p = (struct shm_priv *)priv;
+    xcb_connection_t *xcb_connection = XGetXCBConnection(p->dpy);
+    Window root = RootWindow(p->dpy, p->screen);
+    struct shm_buffer *buffer;
+    xcb_generic_error_t *error;
+    Pixmap pixmap;
+    int shmid;
+
+    TRACE("present_priv=%p dmaBufFd=%d\n", present_priv, fd);
+
+    if (!out)
+        return FALSE;
+
+    if (bpp != 16 && bpp != 32)
+    {
+        ERR("Unsupported bpp %d\n", bpp);
+        return FALSE;
+    }
+
+    buffer = calloc(1, sizeof(struct shm_buffer));
+    if (!buffer)
+        return FALSE;
+
+    buffer->fd = fd;
+    buffer->stride = stride;
+    buffer->height = height;
+    buffer->row_size = width * bpp / 8;
+    /* the server pads shm pixmap rows to 32 bits */
+    buffer->shm_stride = (buffer->row_size + 3) & ~3;
+
+    buffer->map = mmap(NULL, (size_t)stride * height, PROT_READ, MAP_SHARED, fd, 0);
+    if (buffer->map == MAP_FAILED)
+    {
+        buffer->map = NULL;
+        ERR("Failed to map the dma-buf, errno %d\n", errno);
+        goto fail;
+    }
+
+    shmid = shmget(IPC_PRIVATE, (size_t)buffer->shm_stride * height, IPC_CREAT | 0600);
+    if (shmid < 0)
+    {
+        ERR("shmget failed, errno %d\n", errno);
+        goto fail;
+    }
+
+    buffer->shm = shmat(shmid, NULL, 0);
+    if (buffer->shm == (void *)-1)
+    {
+        buffer->shm = NULL;
+        shmctl(shmid, IPC_RMID, NULL);
+        goto fail;
+    }
+
+    buffer->seg = xcb_generate_id(xcb_connection);
+    error = xcb_request_check(xcb_connection,
+            xcb_shm_attach_checked(xcb_connection, buffer->seg, shmid, FALSE));
+    /* the segment goes away once both sides detached */
+    shmctl(shmid, IPC_RMID, NULL);
+    if (error)
+    {
+        free(error);
+        buffer->seg = 0;
+        ERR("Failed to attach the segment to the X server\n");
+        goto fail;
+    }
+
+    pixmap = xcb_generate_id(xcb_connection);
+    error = xcb_request_check(xcb_connection,
+            xcb_shm_create_pixmap_checked(xcb_connection, pixmap, root,
+                    width, height, depth, buffer->seg, 0));
+    if (error)
+    {
+        free(error);
+        ERR("Failed to create the shm pixmap\n");
+        goto fail;
+    }
+
+    *out = calloc(1, sizeof(struct D3DWindowBuffer));
+    if (!*out)
+        goto fail_pixmap;
+
+    if (!PRESENTPixmapInit(present_priv, pixmap, &((*out)->present_pixmap_priv)))
+    {
+        ERR("PRESENTPixmapInit failed\n");
+        free(*out);
+        goto fail_pixmap;
+    }
+
+    (*out)->priv = (struct buffer_priv *)buffer;
+    return TRUE;
+
+fail_pixmap:
+    xcb_free_pixmap(xcb_connection, pixmap);
+fail:
+    shm_free_buffer(xcb_connection, buffer);
+    return FALSE;
+}
+
+static BOOL shm_copy_front(PRESENTPixmapPriv *present_pixmap_priv)
+{
+    /* the shm pixmap isn't the buffer Nine reads */
+    return FALSE;
+}
+
+/* copies the rows that can reach the window */
+static BOOL shm_present_pixmap(struct dri_backend_priv *priv, struct buffer_priv *buffer_priv,
+        const RECT *pSourceRect, const RGNDATA *pDirtyRegion)
+{
+    struct shm_buffer *buffer = (struct shm_buffer *)buffer_priv;
+    struct dma_buf_sync sync = { 0 };
+    LONG top = 0, bottom = buffer->height;
+    const uint8_t *src;
+    uint8_t *dst;
+    LONG y;
+
+    if (pDirtyRegion && pDirtyRegion->rdh.nCount)
+    {
+        const RECT *rects = (const RECT *)pDirtyRegion->Buffer;
+        unsigned i;
+
+        top = bottom;
+        bottom = 0;
+        for (i = 0; i < pDirtyRegion->rdh.nCount; i++)
+        {
+            if (rects[i].top < top)
+                top = rects[i].top;
+            if (rects[i].bottom > bottom)
+                bottom = rects[i].bottom;
+        }
+    }
+    if (pSourceRect)
+    {
+        if (pSourceRect->top > top)
+            top = pSourceRect->top;
+        if (pSourceRect->bottom < bottom)
+            bottom = pSourceRect->bottom;
+    }
+    if (top < 0)
+        top = 0;
+    if (bottom > (LONG)buffer->height)
+        bottom = buffer->height;
+    if (top >= bottom)
+        return TRUE;
+
+    /* waits for the rendering to finish */
+    sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+    ioctl(buffer->fd, DMA_BUF_IOCTL_SYNC, &sync);
+
+    src = (const uint8_t *)buffer->map + (size_t)top * buffer->stride;
+    dst = (uint8_t *)buffer->shm + (size_t)top * buffer->shm_stride;
+    if (buffer->stride == buffer->shm_stride)
+        shm_copy(dst, src, (size_t)(bottom - top) * buffer->stride);
+    else
+    {
+        for (y = top; y < bottom; y++, src += buffer->stride, dst += buffer->shm_stride)
+            shm_copy(dst, src, buffer->row_size);
+    }
+
+    sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+    ioctl(buffer->fd, DMA_BUF_IOCTL_SYNC, &sync);
+
+    return TRUE;
+}
+
+static void shm_destroy_pixmap(struct dri_backend_priv *priv, struct buffer_priv *buffer_priv)
+{
+    struct shm_priv *p = (struct shm_priv *)priv;
+
+    shm_free_buffer(XGetXCBConnection(p->dpy), (struct shm_buffer *)buffer_priv);
+}
+
+const struct dri_backend_funcs shm_funcs = {
+    .name = "shm",
+    .probe = shm_probe,
+    .enumerate = shm_enumerate,
+    .create = shm_create,
+    .destroy = shm_destroy,
+    .init = shm_init,
+    .deinit = shm_deinit,
+    .get_fd = shm_get_fd,
+    .window_buffer_from_dmabuf = shm_window_buffer_from_dmabuf,
+    .copy_front = shm_copy_front,
+    .present_pixmap = shm_present_pixmap,
+    .destroy_pixmap = shm_destroy_pixmap,
+};
+
+#endif /* D3D9NINE_SHM */
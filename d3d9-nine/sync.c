@@ -0,0 +1,517 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Wine D3D9 present sync groups and timed presents
+ *
+ * Windows of a sync group present their frames on the same vblank, e.g.
+ * for video walls driven by several swapchains or devices. A Present only
+ * queues the frame in its group, the member completing the group submits
+ * the frames of all members, targeting the latest vblank any member
+ * proposed. Nobody waits, so the members may be driven by one thread. As
+ * PRESENT counts MSCs per CRTC, the common target is a UST that each member
+ * converts to its own MSC. The spread of the flip times reported for the
+ * frames released together is kept as skew.
+ *
+ * A window can also get a target time for its next Present, the error
+ * between the target and the actual flip is kept per window.
+ */
+
+#include <d3d9.h>
+#include <d3d9_sdl.h>
+#include <stdlib.h>
+#include <SDL2/SDL.h>
+
+#include "../common/debug.h"
+#include "sync.h"
+
+/* released frames whose flips are still awaited for the skew */
+#define SYNC_RELEASES 4
+
+struct sync_member
+{
+    struct sync_member *next;
+    HWND hwnd;
+    struct sync_group *group; /* NULL if only timed presents are used */
+
+    uint64_t present_ust; /* target of the next Present, 0 if none */
+    D3D9SDL_TIMINGSTATS timing;
+};
+
+/* a frame released to all members, waiting for their flips */
+struct sync_release
+{
+    uint64_t target_ust;
+    unsigned nframes;
+    unsigned ncomplete;
+    uint64_t min_ust;
+    uint64_t max_ust;
+};
+
+struct sync_group
+{
+    struct sync_group *next;
+    UINT id;
+    unsigned nmembers;
+
+    /* frames of the current group frame, in queue order */
+    struct sync_frame *frames;
+    unsigned nframes;
+    uint64_t target_ust;
+
+    struct sync_release releases[SYNC_RELEASES];
+    unsigned next_release;
+
+    D3D9SDL_SYNCSTATS stats;
+    uint64_t skew_sum;
+    UINT skew_frames;
+};
+
+static SDL_SpinLock sync_init_lock;
+/* held while frames are submitted, SDL mutexes are recursive,
+ * so submit may report presents */
+static SDL_mutex *sync_mutex;
+static struct sync_member *members;
+static struct sync_group *groups;
+
+static void sync_init(void)
+{
+    SDL_AtomicLock(&sync_init_lock);
+    if (!sync_mutex)
+        sync_mutex = SDL_CreateMutex();
+    SDL_AtomicUnlock(&sync_init_lock);
+}
+
+static struct sync_member *sync_find_member(HWND hwnd)
+{
+    struct sync_member *member;
+
+    for (member = members; member; member = member->next)
+    {
+        if (member->hwnd == hwnd)
+            return member;
+    }
+    return NULL;
+}
+
+static struct sync_group *sync_find_group(UINT id)
+{
+    struct sync_group *group;
+
+    for (group = groups; group; group = group->next)
+    {
+        if (group->id == id)
+            return group;
+    }
+    return NULL;
+}
+
+/* must be called with sync_mutex held */
+static void sync_submit_frames(struct sync_frame *frames, uint64_t target_ust)
+{
+    struct sync_frame *frame, *next;
+
+    for (frame = frames; frame; frame = next)
+    {
+        next = frame->next;
+        frame->next = NULL;
+        frame->submit(frame, target_ust ? target_ust : frame->next_ust);
+    }
+}
+
+/* Submits the queued frames. A frame released to every member is tracked
+ * until their flips are reported, the others only count as timeout.
+ * Must be called with sync_mutex held. */
+static void sync_release_frames(struct sync_group *group, BOOL complete)
+{
+    struct sync_frame *frames = group->frames;
+    uint64_t target_ust = group->target_ust;
+    struct sync_release *release;
+
+    if (!frames)
+        return;
+
+    if (complete)
+    {
+        group->stats.Frames++;
+
+        release = &group->releases[group->next_release];
+        group->next_release = (group->next_release + 1) % SYNC_RELEASES;
+        release->target_ust = target_ust;
+        release->nframes = group->nframes;
+        release->ncomplete = 0;
+        release->min_ust = 0;
+        release->max_ust = 0;
+
+        TRACE("group %u: frame %u, target %llu us\n", group->id,
+              group->stats.Frames, (unsigned long long)target_ust);
+    }
+    else
+    {
+        /* a member presented again before the others had a frame */
+        WARN("group %u: released %u of %u members\n", group->id,
+             group->nframes, group->nmembers);
+        group->stats.Timeouts++;
+    }
+
+    group->frames = NULL;
+    group->nframes = 0;
+    group->target_ust = 0;
+
+    sync_submit_frames(frames, complete ? target_ust : 0);
+}
+
+/* removes the frames matching hwnd or owner from the queue, returns them.
+ * Must be called with sync_mutex held. */
+static struct sync_frame *sync_unlink_frames(struct sync_group *group, HWND hwnd, void *owner)
+{
+    struct sync_frame *frame, **prev, *removed = NULL, **tail = &removed;
+
+    group->target_ust = 0;
+    for (prev = &group->frames; (frame = *prev);)
+    {
+        if ((hwnd && frame->hwnd == hwnd) || (owner && frame->owner == owner))
+        {
+            *prev = frame->next;
+            frame->next = NULL;
+            *tail = frame;
+            tail = &frame->next;
+            group->nframes--;
+            continue;
+        }
+
+        if (frame->next_ust > group->target_ust)
+            group->target_ust = frame->next_ust;
+        prev = &frame->next;
+    }
+
+    return removed;
+}
+
+/* must be called with sync_mutex held */
+static struct sync_member *sync_get_member(HWND hwnd)
+{
+    struct sync_member *member = sync_find_member(hwnd);
+
+    if (member)
+        return member;
+
+    member = calloc(1, sizeof(*member));
+    if (!member)
+        return NULL;
+    member->hwnd = hwnd;
+    member->next = members;
+    members = member;
+
+    return member;
+}
+
+/* must be called with sync_mutex held */
+static void sync_leave_group(struct sync_member *member)
+{
+    struct sync_group *group = member->group;
+
+    if (!group)
+        return;
+
+    /* its frame goes out on its own, the others may be complete now */
+    sync_submit_frames(sync_unlink_frames(group, member->hwnd, NULL), 0);
+    member->group = NULL;
+    group->nmembers--;
+    if (group->nframes && group->nframes >= group->nmembers)
+        sync_release_frames(group, TRUE);
+}
+
+BOOL sync_set_group(HWND hwnd, UINT id)
+{
+    struct sync_member *member;
+    struct sync_group *group;
+    BOOL ret = TRUE;
+
+    if (!hwnd)
+        return FALSE;
+
+    /* nothing to leave */
+    if (!id && !sync_mutex)
+        return TRUE;
+
+    sync_init();
+
+    SDL_LockMutex(sync_mutex);
+
+    member = sync_find_member(hwnd);
+    if (member && member->group && member->group->id == id)
+        goto out;
+
+    if (member)
+        sync_leave_group(member);
+
+    if (!id)
+        goto out;
+
+    group = sync_find_group(id);
+    if (!group)
+    {
+        group = calloc(1, sizeof(*group));
+        if (!group)
+        {
+            ret = FALSE;
+            goto out;
+        }
+        group->id = id;
+        group->next = groups;
+        groups = group;
+    }
+
+    member = sync_get_member(hwnd);
+    if (!member)
+    {
+        ret = FALSE;
+        goto out;
+    }
+    member->group = group;
+    group->nmembers++;
+
+    TRACE("hwnd %p joined sync group %u with %u members\n", hwnd, id, group->nmembers);
+
+out:
+    SDL_UnlockMutex(sync_mutex);
+    return ret;
+}
+
+BOOL sync_get_stats(UINT id, D3D9SDL_SYNCSTATS *stats)
+{
+    struct sync_group *group;
+
+    sync_init();
+
+    SDL_LockMutex(sync_mutex);
+    group = sync_find_group(id);
+    if (group)
+        *stats = group->stats;
+    SDL_UnlockMutex(sync_mutex);
+
+    return group != NULL;
+}
+
+void sync_remove_window(HWND hwnd)
+{
+    struct sync_member *member, **prev;
+
+    if (!sync_mutex)
+        return;
+
+    SDL_LockMutex(sync_mutex);
+    for (prev = &members; (member = *prev); prev = &member->next)
+    {
+        if (member->hwnd == hwnd)
+        {
+            sync_leave_group(member);
+            *prev = member->next;
+            free(member);
+            break;
+        }
+    }
+    SDL_UnlockMutex(sync_mutex);
+}
+
+BOOL sync_set_present_time(HWND hwnd, uint64_t target_ust)
+{
+    struct sync_member *member;
+
+    if (!hwnd)
+        return FALSE;
+
+    sync_init();
+
+    SDL_LockMutex(sync_mutex);
+    member = sync_get_member(hwnd);
+    if (member)
+        member->present_ust = target_ust;
+    SDL_UnlockMutex(sync_mutex);
+
+    return member != NULL;
+}
+
+BOOL sync_begin_present(HWND hwnd, uint64_t *target_ust)
+{
+    struct sync_member *member;
+    BOOL ret = FALSE;
+
+    *target_ust = 0;
+
+    /* neither extension was ever used */
+    if (!sync_mutex)
+        return FALSE;
+
+    SDL_LockMutex(sync_mutex);
+    member = sync_find_member(hwnd);
+    if (member)
+    {
+        *target_ust = member->present_ust;
+        member->present_ust = 0;
+        ret = member->group != NULL;
+    }
+    SDL_UnlockMutex(sync_mutex);
+
+    return ret;
+}
+
+/* a member flipped the frame released for target_ust at ust,
+ * must be called with sync_mutex held */
+static void sync_report_flip(struct sync_group *group, uint64_t target_ust, uint64_t ust)
+{
+    struct sync_release *release = NULL;
+    uint64_t skew;
+    unsigned i;
+
+    for (i = 0; i < SYNC_RELEASES; i++)
+    {
+        if (group->releases[i].nframes && group->releases[i].target_ust == target_ust)
+        {
+            release = &group->releases[i];
+            break;
+        }
+    }
+    if (!release)
+        return;
+
+    if (!release->ncomplete || ust < release->min_ust)
+        release->min_ust = ust;
+    if (ust > release->max_ust)
+        release->max_ust = ust;
+    if (++release->ncomplete < release->nframes)
+        return;
+
+    skew = (release->max_ust - release->min_ust) * 1000;
+    release->nframes = 0;
+
+    group->skew_frames++;
+    group->stats.LastSkew = skew;
+    if (skew > group->stats.MaxSkew)
+        group->stats.MaxSkew = skew;
+    group->skew_sum += skew;
+    group->stats.AverageSkew = group->skew_sum / group->skew_frames;
+
+    TRACE("group %u: target %llu us, skew %llu ns\n", group->id,
+          (unsigned long long)target_ust, (unsigned long long)skew);
+}
+
+void sync_report_present(HWND hwnd, uint64_t target_ust, uint64_t ust)
+{
+    struct sync_member *member;
+    int64_t error = ((int64_t)ust - (int64_t)target_ust) * 1000;
+
+    if (!sync_mutex)
+        return;
+
+    SDL_LockMutex(sync_mutex);
+    member = sync_find_member(hwnd);
+    if (member)
+    {
+        member->timing.Frames++;
+        member->timing.LastTarget = target_ust * 1000;
+        member->timing.LastActual = ust * 1000;
+        member->timing.LastError = error;
+        if ((UINT64)(error < 0 ? -error : error) > member->timing.MaxError)
+            member->timing.MaxError = error < 0 ? -error : error;
+        if (member->group)
+            sync_report_flip(member->group, target_ust, ust);
+    }
+    SDL_UnlockMutex(sync_mutex);
+
+    TRACE("hwnd %p: target %llu us, actual %llu us, error %lld ns\n", hwnd,
+          (unsigned long long)target_ust, (unsigned long long)ust, (long long)error);
+}
+
+BOOL sync_get_timing(HWND hwnd, D3D9SDL_TIMINGSTATS *stats)
+{
+    struct sync_member *member;
+
+    if (!sync_mutex)
+        return FALSE;
+
+    SDL_LockMutex(sync_mutex);
+    member = sync_find_member(hwnd);
+    if (member)
+        *stats = member->timing;
+    SDL_UnlockMutex(sync_mutex);
+
+    return member != NULL;
+}
+
+BOOL sync_queue_frame(struct sync_frame *frame)
+{
+    struct sync_member *member;
+    struct sync_group *group;
+    struct sync_frame **tail;
+
+    if (!sync_mutex)
+        return FALSE;
+
+    SDL_LockMutex(sync_mutex);
+
+    member = sync_find_member(frame->hwnd);
+    if (!member || !member->group)
+    {
+        SDL_UnlockMutex(sync_mutex);
+        return FALSE;
+    }
+    group = member->group;
+
+    /* presenting again, the members that didn't present aren't waited for */
+    for (tail = &group->frames; *tail; tail = &(*tail)->next)
+    {
+        if ((*tail)->hwnd == frame->hwnd)
+        {
+            sync_release_frames(group, FALSE);
+            tail = &group->frames;
+            break;
+        }
+    }
+
+    frame->next = NULL;
+    *tail = frame;
+    group->nframes++;
+    if (frame->next_ust > group->target_ust)
+        group->target_ust = frame->next_ust;
+
+    if (group->nframes >= group->nmembers)
+        sync_release_frames(group, TRUE);
+
+    SDL_UnlockMutex(sync_mutex);
+
+    return TRUE;
+}
+
+void sync_flush_frames(void *owner)
+{
+    struct sync_group *group;
+
+    if (!sync_mutex)
+        return;
+
+    SDL_LockMutex(sync_mutex);
+    for (group = groups; group; group = group->next)
+        sync_submit_frames(sync_unlink_frames(group, NULL, owner), 0);
+    SDL_UnlockMutex(sync_mutex);
+}
+
+BOOL sync_is_held(void *owner, const void *data)
+{
+    struct sync_group *group;
+    struct sync_frame *frame;
+    BOOL ret = FALSE;
+
+    if (!sync_mutex)
+        return FALSE;
+
+    /* frames are submitted with sync_mutex held */
+    SDL_LockMutex(sync_mutex);
+    for (group = groups; group && !ret; group = group->next)
+    {
+        for (frame = group->frames; frame && !ret; frame = frame->next)
+            ret = frame->owner == owner && (!data || frame->data == data);
+    }
+    SDL_UnlockMutex(sync_mutex);
+
+    return ret;
+}
@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Wine D3D9 present sync groups and timed presents
+ */
+
+#ifndef __NINE_SYNC_H
+#define __NINE_SYNC_H
+
+#include <d3d9types.h>
+#include <stdint.h>
+
+struct _D3D9SDL_SYNCSTATS;
+struct _D3D9SDL_TIMINGSTATS;
+
+/* group 0 removes the window from its group */
+BOOL sync_set_group(HWND hwnd, UINT group);
+
+BOOL sync_get_stats(UINT group, struct _D3D9SDL_SYNCSTATS *stats);
+
+/* forget the window's group and timing */
+void sync_remove_window(HWND hwnd);
+
+/* target time (UST in us) for the window's next Present */
+BOOL sync_set_present_time(HWND hwnd, uint64_t target_ust);
+
+/* takes the target time of this Present, 0 if none,
+ * returns TRUE if the window is in a sync group */
+BOOL sync_begin_present(HWND hwnd, uint64_t *target_ust);
+
+/* a present with a target time completed at ust */
+void sync_report_present(HWND hwnd, uint64_t target_ust, uint64_t ust);
+
+BOOL sync_get_timing(HWND hwnd, struct _D3D9SDL_TIMINGSTATS *stats);
+
+/* a Present held back until every member of its sync group has one */
+struct sync_frame
+{
+    struct sync_frame *next;
+    HWND hwnd;
+    void *owner; /* the swapchain, for sync_flush_frames */
+    const void *data; /* the presented buffer, for sync_is_held */
+    uint64_t next_ust; /* the vblank the frame would hit on its own */
+    /* presents the frame on the vblank at target_ust and frees it,
+     * called by whichever thread releases the frame */
+    void (*submit)(struct sync_frame *frame, uint64_t target_ust);
+};
+
+/* Holds the frame in the window's sync group. The member completing the
+ * group submits the frames of all members, targeting the latest next_ust.
+ * Returns FALSE if the window isn't in a group, the frame isn't held then. */
+BOOL sync_queue_frame(struct sync_frame *frame);
+
+/* submits the held frames of owner right away, e.g. before its buffers go away */
+void sync_flush_frames(void *owner);
+
+/* TRUE while a frame of owner with data, or any frame of owner if data is
+ * NULL, is held. Waits for submissions by other threads to complete. */
+BOOL sync_is_held(void *owner, const void *data);
+
+#endif /* __NINE_SYNC_H */
@@ -0,0 +1,507 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Wine D3D9 window state tracking
+ *
+ * Tracks the visibility of the windows used for presentation. SDL only
+ * knows about minimized and hidden windows, so a dedicated xcb connection
+ * additionally listens for VisibilityNotify, map state and _NET_WM_STATE
+ * changes. Events are processed when the state is queried, no extra thread
+ * is needed.
+ *
+ * The X window, its size and depth are cached as well, so presenting a frame
+ * doesn't need to query SDL or the X server.
+ */
+
+#include <d3d9types.h>
+#include <xcb/xcb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_syswm.h>
+#include <d3d9.h>
+#include <d3d9_sdl.h>
+
+#include "../common/debug.h"
+#include "window.h"
+
+struct window
+{
+    struct window *next;
+    HWND hwnd;
+    Uint32 id; /* SDL window id */
+    LONG refs;
+    xcb_window_t xid;
+    int width;
+    int height;
+    int depth;
+
+    /* from SDL window events */
+    BOOL hidden;
+    BOOL minimized;
+    BOOL focused;
+
+    /* from X events */
+    BOOL unmapped;
+    BOOL obscured;
+    BOOL wm_hidden;
+
+    /* from PRESENT complete events */
+    D3D9SDL_FLIPSTATS flip_stats;
+};
+
+static SDL_SpinLock window_init_lock;
+static SDL_mutex *window_mutex;
+static struct window *windows;
+
+static xcb_connection_t *window_xcb;
+static xcb_atom_t atom_net_wm_state;
+static xcb_atom_t atom_net_wm_state_hidden;
+
+static struct window *window_find(HWND hwnd)
+{
+    struct window *window;
+
+    for (window = windows; window; window = window->next)
+    {
+        if (window->hwnd == hwnd)
+            return window;
+    }
+    return NULL;
+}
+
+static struct window *window_find_xid(xcb_window_t xid)
+{
+    struct window *window;
+
+    for (window = windows; window; window = window->next)
+    {
+        if (window->xid == xid)
+            return window;
+    }
+    return NULL;
+}
+
+static xcb_atom_t window_intern_atom(const char *name)
+{
+    xcb_intern_atom_reply_t *reply;
+    xcb_atom_t atom = XCB_ATOM_NONE;
+
+    reply = xcb_intern_atom_reply(window_xcb,
+            xcb_intern_atom(window_xcb, 0, strlen(name), name), NULL);
+    if (reply)
+    {
+        atom = reply->atom;
+        free(reply);
+    }
+    return atom;
+}
+
+static BOOL window_query_wm_hidden(xcb_window_t xid)
+{
+    xcb_get_property_reply_t *reply;
+    const xcb_atom_t *atoms;
+    BOOL hidden = FALSE;
+    int i, n;
+
+    reply = xcb_get_property_reply(window_xcb,
+            xcb_get_property(window_xcb, 0, xid, atom_net_wm_state,
+                             XCB_ATOM_ATOM, 0, 32), NULL);
+    if (!reply)
+        return FALSE;
+
+    atoms = xcb_get_property_value(reply);
+    n = xcb_get_property_value_length(reply) / sizeof(xcb_atom_t);
+    for (i = 0; i < n; i++)
+    {
+        if (atoms[i] == atom_net_wm_state_hidden)
+            hidden = TRUE;
+    }
+    free(reply);
+    return hidden;
+}
+
+/* must be called with window_mutex held */
+static void window_process_xcb_events(void)
+{
+    xcb_generic_event_t *event;
+    struct window *window;
+
+    if (!window_xcb)
+        return;
+
+    while ((event = xcb_poll_for_event(window_xcb)))
+    {
+        switch (event->response_type & ~0x80)
+        {
+            case XCB_VISIBILITY_NOTIFY:
+            {
+                xcb_visibility_notify_event_t *ev = (xcb_visibility_notify_event_t *)event;
+                if ((window = window_find_xid(ev->window)))
+                    window->obscured = ev->state == XCB_VISIBILITY_FULLY_OBSCURED;
+                break;
+            }
+            case XCB_MAP_NOTIFY:
+            {
+                xcb_map_notify_event_t *ev = (xcb_map_notify_event_t *)event;
+                if ((window = window_find_xid(ev->window)))
+                    window->unmapped = FALSE;
+                break;
+            }
+            case XCB_CONFIGURE_NOTIFY:
+            {
+                xcb_configure_notify_event_t *ev = (xcb_configure_notify_event_t *)event;
+                if ((window = window_find_xid(ev->window)))
+                {
+                    window->width = ev->width;
+                    window->height = ev->height;
+                }
+                break;
+            }
+            case XCB_UNMAP_NOTIFY:
+            {
+                xcb_unmap_notify_event_t *ev = (xcb_unmap_notify_event_t *)event;
+                if ((window = window_find_xid(ev->window)))
+                    window->unmapped = TRUE;
+                break;
+            }
+            case XCB_PROPERTY_NOTIFY:
+            {
+                xcb_property_notify_event_t *ev = (xcb_property_notify_event_t *)event;
+                if (ev->atom == atom_net_wm_state && (window = window_find_xid(ev->window)))
+                    window->wm_hidden = window_query_wm_hidden(ev->window);
+                break;
+            }
+            default:
+                /* errors of windows destroyed before being released */
+                break;
+        }
+        free(event);
+    }
+}
+
+static int window_event_watch(void *userdata, SDL_Event *event)
+{
+    struct window *window;
+
+    if (event->type != SDL_WINDOWEVENT)
+        return 0;
+
+    SDL_LockMutex(window_mutex);
+    for (window = windows; window; window = window->next)
+    {
+        if (window->id != event->window.windowID)
+            continue;
+
+        switch (event->window.event)
+        {
+            case SDL_WINDOWEVENT_SHOWN:
+                window->hidden = FALSE;
+                break;
+            case SDL_WINDOWEVENT_HIDDEN:
+                window->hidden = TRUE;
+                break;
+            case SDL_WINDOWEVENT_MINIMIZED:
+                window->minimized = TRUE;
+                break;
+            case SDL_WINDOWEVENT_MAXIMIZED:
+            case SDL_WINDOWEVENT_RESTORED:
+                window->minimized = FALSE;
+                break;
+            case SDL_WINDOWEVENT_FOCUS_GAINED:
+                window->focused = TRUE;
+                break;
+            case SDL_WINDOWEVENT_FOCUS_LOST:
+                window->focused = FALSE;
+                break;
+            case SDL_WINDOWEVENT_SIZE_CHANGED:
+                window->width = event->window.data1;
+                window->height = event->window.data2;
+                break;
+            default:
+                break;
+        }
+    }
+    SDL_UnlockMutex(window_mutex);
+
+    return 0;
+}
+
+static void window_x11_init(struct window *window)
+{
+    static const uint32_t event_mask = XCB_EVENT_MASK_VISIBILITY_CHANGE |
+            XCB_EVENT_MASK_STRUCTURE_NOTIFY | XCB_EVENT_MASK_PROPERTY_CHANGE;
+    xcb_get_window_attributes_reply_t *attr;
+    xcb_get_geometry_reply_t *geom;
+    SDL_SysWMinfo wm;
+
+    SDL_VERSION(&wm.version);
+    if (!SDL_GetWindowWMInfo(window->hwnd, &wm) || wm.subsystem != SDL_SYSWM_X11)
+        return;
+
+    window->xid = wm.info.x11.window;
+
+    if (!window_xcb)
+    {
+        window_xcb = xcb_connect(NULL, NULL);
+        if (xcb_connection_has_error(window_xcb))
+        {
+            WARN("Failed to open xcb connection, window state is only tracked by SDL\n");
+            xcb_disconnect(window_xcb);
+            window_xcb = NULL;
+            return;
+        }
+        atom_net_wm_state = window_intern_atom("_NET_WM_STATE");
+        atom_net_wm_state_hidden = window_intern_atom("_NET_WM_STATE_HIDDEN");
+    }
+
+    /* Every client has its own event mask, this doesn't interfere with SDL's */
+    xcb_change_window_attributes(window_xcb, window->xid, XCB_CW_EVENT_MASK, &event_mask);
+
+    attr = xcb_get_window_attributes_reply(window_xcb,
+            xcb_get_window_attributes(window_xcb, window->xid), NULL);
+    if (attr)
+    {
+        window->unmapped = attr->map_state == XCB_MAP_STATE_UNMAPPED;
+        free(attr);
+    }
+    window->wm_hidden = window_query_wm_hidden(window->xid);
+
+    geom = xcb_get_geometry_reply(window_xcb,
+            xcb_get_geometry(window_xcb, window->xid), NULL);
+    if (geom)
+    {
+        window->depth = geom->depth;
+        free(geom);
+    }
+}
+
+BOOL window_acquire(HWND hwnd)
+{
+    struct window *window;
+    Uint32 flags;
+
+    if (!hwnd)
+        return FALSE;
+
+    /* SDL calls the watch with its event lock held, so it is added once
+     * and never while holding window_mutex */
+    SDL_AtomicLock(&window_init_lock);
+    if (!window_mutex)
+    {
+        window_mutex = SDL_CreateMutex();
+        SDL_AddEventWatch(window_event_watch, NULL);
+    }
+    SDL_AtomicUnlock(&window_init_lock);
+
+    SDL_LockMutex(window_mutex);
+
+    window = window_find(hwnd);
+    if (window)
+    {
+        window->refs++;
+        SDL_UnlockMutex(window_mutex);
+        return TRUE;
+    }
+
+    window = calloc(1, sizeof(*window));
+    if (!window)
+    {
+        SDL_UnlockMutex(window_mutex);
+        return FALSE;
+    }
+
+    flags = SDL_GetWindowFlags(hwnd);
+    window->hwnd = hwnd;
+    window->id = SDL_GetWindowID(hwnd);
+    window->refs = 1;
+    window->hidden = !!(flags & SDL_WINDOW_HIDDEN);
+    window->minimized = !!(flags & SDL_WINDOW_MINIMIZED);
+    window->focused = !!(flags & SDL_WINDOW_INPUT_FOCUS);
+    window->depth = 24;
+    SDL_GetWindowSize(hwnd, &window->width, &window->height);
+    window_x11_init(window);
+
+    window->next = windows;
+    windows = window;
+
+    SDL_UnlockMutex(window_mutex);
+
+    TRACE("Tracking window %p (xid %#x, %dx%d, depth %d)\n", hwnd, window->xid,
+          window->width, window->height, window->depth);
+    return TRUE;
+}
+
+void window_release(HWND hwnd)
+{
+    struct window **pwindow, *window;
+    static const uint32_t no_events = 0;
+
+    if (!hwnd || !window_mutex)
+        return;
+
+    SDL_LockMutex(window_mutex);
+    for (pwindow = &windows; (window = *pwindow); pwindow = &window->next)
+    {
+        if (window->hwnd != hwnd)
+            continue;
+
+        if (--window->refs)
+            break;
+
+        *pwindow = window->next;
+        if (window->xid && window_xcb)
+            xcb_change_window_attributes(window_xcb, window->xid, XCB_CW_EVENT_MASK, &no_events);
+        free(window);
+        break;
+    }
+
+    if (!windows && window_xcb)
+    {
+        xcb_disconnect(window_xcb);
+        window_xcb = NULL;
+    }
+    SDL_UnlockMutex(window_mutex);
+}
+
+BOOL window_is_occluded(HWND hwnd, BOOL covered)
+{
+    struct window *window;
+    BOOL occluded;
+
+    if (!hwnd)
+        return FALSE;
+
+    if (window_mutex)
+    {
+        SDL_LockMutex(window_mutex);
+        window_process_xcb_events();
+        window = window_find(hwnd);
+        if (window)
+        {
+            occluded = window->hidden || window->minimized;
+            if (covered)
+                occluded |= window->unmapped || window->obscured || window->wm_hidden;
+            SDL_UnlockMutex(window_mutex);
+            return occluded;
+        }
+        SDL_UnlockMutex(window_mutex);
+    }
+
+    return !!(SDL_GetWindowFlags(hwnd) & (SDL_WINDOW_MINIMIZED | SDL_WINDOW_HIDDEN));
+}
+
+BOOL window_has_focus(HWND hwnd)
+{
+    struct window *window;
+    BOOL focused;
+
+    if (!hwnd)
+        return FALSE;
+
+    if (window_mutex)
+    {
+        SDL_LockMutex(window_mutex);
+        window = window_find(hwnd);
+        if (window)
+        {
+            focused = window->focused;
+            SDL_UnlockMutex(window_mutex);
+            return focused;
+        }
+        SDL_UnlockMutex(window_mutex);
+    }
+
+    return !!(SDL_GetWindowFlags(hwnd) & SDL_WINDOW_INPUT_FOCUS);
+}
+
+BOOL window_get_info(HWND hwnd, struct window_info *info)
+{
+    struct window *window;
+    SDL_SysWMinfo wm;
+
+    if (!hwnd)
+        return FALSE;
+
+    if (window_mutex)
+    {
+        SDL_LockMutex(window_mutex);
+        window_process_xcb_events();
+        window = window_find(hwnd);
+        if (window && window->xid)
+        {
+            info->xid = window->xid;
+            info->width = window->width;
+            info->height = window->height;
+            info->depth = window->depth;
+            SDL_UnlockMutex(window_mutex);
+            return TRUE;
+        }
+        SDL_UnlockMutex(window_mutex);
+    }
+
+    /* not tracked, e.g. a window override */
+    SDL_VERSION(&wm.version);
+    if (!SDL_GetWindowWMInfo(hwnd, &wm) || wm.subsystem != SDL_SYSWM_X11)
+        return FALSE;
+
+    info->xid = wm.info.x11.window;
+    SDL_GetWindowSize(hwnd, &info->width, &info->height);
+    info->depth = 24;
+    return TRUE;
+}
+
+void window_update_size(HWND hwnd)
+{
+    struct window *window;
+
+    if (!hwnd || !window_mutex)
+        return;
+
+    SDL_LockMutex(window_mutex);
+    window = window_find(hwnd);
+    if (window)
+        SDL_GetWindowSize(hwnd, &window->width, &window->height);
+    SDL_UnlockMutex(window_mutex);
+}
+
+UINT window_count_presents(HWND hwnd, UINT flips, UINT copies)
+{
+    struct window *window;
+    UINT streak = 0;
+
+    if (!hwnd || !window_mutex)
+        return 0;
+
+    SDL_LockMutex(window_mutex);
+    window = window_find(hwnd);
+    if (window)
+    {
+        /* the order within the batch is unknown, a flip ends the streak */
+        window->flip_stats.Flips += flips;
+        window->flip_stats.Copies += copies;
+        if (flips)
+            window->flip_stats.CopyStreak = copies;
+        else
+            window->flip_stats.CopyStreak += copies;
+        streak = window->flip_stats.CopyStreak;
+    }
+    SDL_UnlockMutex(window_mutex);
+
+    return streak;
+}
+
+BOOL window_get_flip_stats(HWND hwnd, D3D9SDL_FLIPSTATS *stats)
+{
+    struct window *window;
+
+    if (!hwnd || !window_mutex)
+        return FALSE;
+
+    SDL_LockMutex(window_mutex);
+    window = window_find(hwnd);
+    if (window)
+        *stats = window->flip_stats;
+    SDL_UnlockMutex(window_mutex);
+
+    return window != NULL;
+}
@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Wine D3D9 window state tracking
+ */
+
+#ifndef __NINE_WINDOW_H
+#define __NINE_WINDOW_H
+
+#include <d3d9types.h>
+#include <X11/Xlib.h>
+
+struct _D3D9SDL_FLIPSTATS;
+
+/* start tracking the window's state from SDL and X events, refcounted */
+BOOL window_acquire(HWND hwnd);
+void window_release(HWND hwnd);
+
+/* minimized or hidden, with covered also unmapped, fully covered
+ * or _NET_WM_STATE_HIDDEN */
+BOOL window_is_occluded(HWND hwnd, BOOL covered);
+
+BOOL window_has_focus(HWND hwnd);
+
+struct window_info
+{
+    XID xid;
+    int width;
+    int height;
+    int depth;
+};
+
+/* cached for acquired windows, updated by window events */
+BOOL window_get_info(HWND hwnd, struct window_info *info);
+
+/* refresh the cached size after changing it through SDL */
+void window_update_size(HWND hwnd);
+
+/* adds completed presents of an acquired window,
+ * returns the number of copies since its last flip */
+UINT window_count_presents(HWND hwnd, UINT flips, UINT copies);
+
+BOOL window_get_flip_stats(HWND hwnd, struct _D3D9SDL_FLIPSTATS *stats);
+
+#endif /* __NINE_WINDOW_H */
@@ -13,17 +13,32 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <SDL2/SDL.h>
 
 #include "../common/debug.h"
 #include "xcb_present.h"
 
+/* timed complete events kept until they are collected, the oldest are dropped */
+#define PRESENT_TIMED_COMPLETES 16
+
 struct PRESENTPriv {
     xcb_connection_t *xcb_connection;
     xcb_connection_t *xcb_connection_bis; /* to avoid libxcb thread bugs, use a different connection to present pixmaps */
     XID window;
     uint64_t last_msc;
+    uint64_t last_ust;
     uint64_t last_target;
+    uint64_t refresh_period; /* in us, measured from complete events */
+    uint64_t target_ust; /* vblank time requested for the next present, 0 if none */
+    struct {
+        uint64_t target_ust;
+        uint64_t ust;
+    } timed[PRESENT_TIMED_COMPLETES]; /* completed presents with a requested time */
+    unsigned timed_first;
+    unsigned ntimed;
+    unsigned flips; /* completed presents by mode */
+    unsigned copies;
     xcb_special_event_t *special_event;
     PRESENTPixmapPriv *first_present_priv;
     int pixmap_present_pending;
@@ -32,6 +47,27 @@ struct PRESENTPriv {
     SDL_mutex* mutex_present; /* protect readind/writing present_priv things */
     SDL_mutex* mutex_xcb_wait;
     BOOL xcb_wait;
+    BOOL adaptive_sync;
+
+    /* VRR pacing and low framerate compensation */
+    BOOL vrr;
+    enum {
+        VRR_DETECTING,
+        VRR_ACTIVE,
+        VRR_INACTIVE
+    } vrr_state;
+    uint64_t vrr_min_period; /* longest frame time the panel can hold, in us */
+    uint64_t vrr_max_period; /* shortest refresh period of the panel, in us */
+    uint64_t vrr_frame_limit; /* pacing deadline between two submissions, in us */
+    unsigned vrr_samples;
+    unsigned vrr_unaligned;
+    uint64_t last_submit_ust;
+    uint64_t frame_interval; /* smoothed time between two submissions, in us */
+    uint64_t lfc_last_ust;
+    PRESENTPixmapPriv *lfc_pixmap;
+    SDL_Thread *lfc_thread;
+    SDL_cond *lfc_cond;
+    BOOL lfc_quit;
 };
 
 struct PRESENTPixmapPriv {
@@ -44,6 +80,8 @@ struct PRESENTPixmapPriv {
     unsigned int present_complete_pending;
     uint32_t serial;
     BOOL last_present_was_flip;
+    uint64_t target_ust; /* requested time of the pending present */
+    unsigned int lfc_idle_skip; /* idle events caused by repeated presents */
     PRESENTPixmapPriv *next;
 };
 
@@ -60,6 +98,15 @@ static xcb_screen_t *screen_of_display(xcb_connection_t *c,
   return NULL;
 }
 
+/* PRESENT reports UST in microseconds of CLOCK_MONOTONIC */
+static uint64_t PRESENTGetUst(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 LONG PRESENTGetNewSerial(void)
 {
     static LONG last_serial_given = 0;
@@ -115,6 +162,74 @@ static PRESENTPixmapPriv *PRESENTFindPixmapPriv(PRESENTpriv *present_priv, uint3
     return NULL;
 }
 
+/* With VRR active the flips complete as soon as they are submitted, so the
+ * intervals between them are not a multiple of the nominal refresh period */
+static void PRESENTDetectVRR(PRESENTpriv *present_priv, uint64_t ust)
+{
+    uint64_t delta, rem, tolerance;
+
+    if (!present_priv->vrr || present_priv->vrr_state != VRR_DETECTING ||
+            !present_priv->last_ust || ust <= present_priv->last_ust)
+        return;
+
+    delta = ust - present_priv->last_ust;
+    rem = delta % present_priv->vrr_max_period;
+    if (present_priv->vrr_max_period - rem < rem)
+        rem = present_priv->vrr_max_period - rem;
+
+    tolerance = present_priv->vrr_max_period / 100;
+    if (tolerance < 100)
+        tolerance = 100;
+
+    if (rem > tolerance)
+        present_priv->vrr_unaligned++;
+
+    if (++present_priv->vrr_samples < 32)
+        return;
+
+    present_priv->vrr_state = present_priv->vrr_unaligned * 4 >= present_priv->vrr_samples ?
+            VRR_ACTIVE : VRR_INACTIVE;
+
+    TRACE("VRR is %s (%u of %u intervals unaligned)\n",
+          present_priv->vrr_state == VRR_ACTIVE ? "active" : "inactive",
+          present_priv->vrr_unaligned, present_priv->vrr_samples);
+}
+
+static void PRESENTUpdateTiming(PRESENTpriv *present_priv, uint64_t msc, uint64_t ust)
+{
+    uint64_t period;
+
+    PRESENTDetectVRR(present_priv, ust);
+
+    if (present_priv->last_ust && msc > present_priv->last_msc && ust > present_priv->last_ust)
+    {
+        period = (ust - present_priv->last_ust) / (msc - present_priv->last_msc);
+
+        /* smooth out jitter of the reported timestamps */
+        if (present_priv->refresh_period)
+            present_priv->refresh_period = (present_priv->refresh_period * 7 + period) / 8;
+        else
+            present_priv->refresh_period = period;
+    }
+    present_priv->last_msc = msc;
+    present_priv->last_ust = ust;
+}
+
+/* Returns TRUE if the vblank of target_msc is already in the past */
+static BOOL PRESENTIsTargetLate(PRESENTpriv *present_priv, uint64_t target_msc)
+{
+    uint64_t target_ust;
+
+    if (!present_priv->refresh_period || !present_priv->last_ust ||
+            target_msc < present_priv->last_msc)
+        return FALSE;
+
+    target_ust = present_priv->last_ust +
+            (target_msc - present_priv->last_msc) * present_priv->refresh_period;
+
+    return PRESENTGetUst() > target_ust;
+}
+
 static void PRESENThandle_events(PRESENTpriv *present_priv, xcb_present_generic_event_t *ge)
 {
     PRESENTPixmapPriv *present_pixmap_priv = NULL;
@@ -143,13 +258,31 @@ static void PRESENThandle_events(PRESENTpriv *present_priv, xcb_present_generic_
             {
                 case XCB_PRESENT_COMPLETE_MODE_FLIP:
                     present_pixmap_priv->last_present_was_flip = TRUE;
+                    present_priv->flips++;
                     break;
                 case XCB_PRESENT_COMPLETE_MODE_COPY:
                     present_pixmap_priv->last_present_was_flip = FALSE;
+                    present_priv->copies++;
                     break;
             }
             present_priv->pixmap_present_pending--;
-            present_priv->last_msc = ce->msc;
+            PRESENTUpdateTiming(present_priv, ce->msc, ce->ust);
+            if (present_pixmap_priv->target_ust)
+            {
+                unsigned i;
+
+                if (present_priv->ntimed == PRESENT_TIMED_COMPLETES)
+                {
+                    present_priv->timed_first = (present_priv->timed_first + 1) %
+                            PRESENT_TIMED_COMPLETES;
+                    present_priv->ntimed--;
+                }
+                i = (present_priv->timed_first + present_priv->ntimed++) %
+                        PRESENT_TIMED_COMPLETES;
+                present_priv->timed[i].target_ust = present_pixmap_priv->target_ust;
+                present_priv->timed[i].ust = ce->ust;
+                present_pixmap_priv->target_ust = 0;
+            }
             break;
         }
         case XCB_PRESENT_EVENT_IDLE_NOTIFY:
@@ -162,6 +295,13 @@ static void PRESENThandle_events(PRESENTpriv *present_priv, xcb_present_generic_
                 free(ie);
                 return;
             }
+            if (present_pixmap_priv->lfc_idle_skip)
+            {
+                /* the pixmap is still on screen because of a repeated present */
+                present_pixmap_priv->lfc_idle_skip--;
+                free(ie);
+                return;
+            }
             present_pixmap_priv->released = TRUE;
             present_priv->idle_notify_since_last_check = TRUE;
             break;
@@ -242,6 +382,227 @@ BOOL PRESENTInit(Display *dpy, PRESENTpriv **present_priv)
     return TRUE;
 }
 
+uint64_t PRESENTGetNextVblankUst(PRESENTpriv *present_priv, UINT PresentationInterval)
+{
+    uint64_t now = PRESENTGetUst();
+    uint64_t period, ust, target_msc;
+
+    SDL_LockMutex(present_priv->mutex_present);
+    PRESENTflush_events(present_priv, FALSE);
+
+    period = present_priv->refresh_period;
+    if (!period || !present_priv->last_ust)
+    {
+        SDL_UnlockMutex(present_priv->mutex_present);
+        return now;
+    }
+
+    /* the same target PRESENTPixmap would pick */
+    target_msc = present_priv->last_msc + (PresentationInterval ? PresentationInterval : 1) *
+            (present_priv->pixmap_present_pending + 1);
+    ust = present_priv->last_ust + (target_msc - present_priv->last_msc) * period;
+    if (ust <= now)
+        ust = now + period - (now - present_priv->last_ust) % period;
+
+    SDL_UnlockMutex(present_priv->mutex_present);
+
+    return ust;
+}
+
+void PRESENTGetFlipStats(PRESENTpriv *present_priv, unsigned *flips, unsigned *copies)
+{
+    SDL_LockMutex(present_priv->mutex_present);
+    PRESENTflush_events(present_priv, FALSE);
+    *flips = present_priv->flips;
+    *copies = present_priv->copies;
+    SDL_UnlockMutex(present_priv->mutex_present);
+}
+
+BOOL PRESENTGetTimedComplete(PRESENTpriv *present_priv, uint64_t *target_ust, uint64_t *ust)
+{
+    BOOL ret;
+
+    SDL_LockMutex(present_priv->mutex_present);
+    PRESENTflush_events(present_priv, FALSE);
+    ret = present_priv->ntimed != 0;
+    if (ret)
+    {
+        *target_ust = present_priv->timed[present_priv->timed_first].target_ust;
+        *ust = present_priv->timed[present_priv->timed_first].ust;
+        present_priv->timed_first = (present_priv->timed_first + 1) % PRESENT_TIMED_COMPLETES;
+        present_priv->ntimed--;
+    }
+    SDL_UnlockMutex(present_priv->mutex_present);
+
+    return ret;
+}
+
+void PRESENTSetTargetUst(PRESENTpriv *present_priv, uint64_t target_ust)
+{
+    SDL_LockMutex(present_priv->mutex_present);
+    present_priv->target_ust = target_ust;
+    SDL_UnlockMutex(present_priv->mutex_present);
+}
+
+void PRESENTSetAdaptiveSync(PRESENTpriv *present_priv, BOOL enable)
+{
+    SDL_LockMutex(present_priv->mutex_present);
+    present_priv->adaptive_sync = enable;
+    SDL_UnlockMutex(present_priv->mutex_present);
+}
+
+/* Low framerate compensation: when frames come slower than the panel's
+ * minimum refresh rate, present the frame on screen again in between. */
+static int PRESENTLfcThread(void *data)
+{
+    PRESENTpriv *present_priv = data;
+    PRESENTPixmapPriv *present_pixmap_priv;
+    uint64_t now, step, mult;
+
+    SDL_LockMutex(present_priv->mutex_present);
+    while (!present_priv->lfc_quit)
+    {
+        present_pixmap_priv = present_priv->lfc_pixmap;
+
+        if (!present_priv->window || !present_pixmap_priv ||
+                present_priv->vrr_state != VRR_ACTIVE ||
+                present_priv->frame_interval <= present_priv->vrr_min_period)
+        {
+            SDL_CondWaitTimeout(present_priv->lfc_cond, present_priv->mutex_present, 100);
+            continue;
+        }
+
+        mult = (present_priv->frame_interval + present_priv->vrr_min_period - 1) /
+                present_priv->vrr_min_period;
+        step = present_priv->frame_interval / mult;
+        if (step < present_priv->vrr_max_period)
+            step = present_priv->vrr_max_period;
+
+        now = PRESENTGetUst();
+        if (now < present_priv->lfc_last_ust + step)
+        {
+            SDL_CondWaitTimeout(present_priv->lfc_cond, present_priv->mutex_present,
+                    (present_priv->lfc_last_ust + step - now) / 1000 + 1);
+            continue;
+        }
+
+        /* Only repeat a pixmap that is still owned by the server,
+         * a released one may already be rendered to again. */
+        if (present_pixmap_priv->released)
+        {
+            present_priv->lfc_pixmap = NULL;
+            continue;
+        }
+
+        xcb_present_pixmap(present_priv->xcb_connection_bis, present_priv->window,
+                present_pixmap_priv->pixmap, present_pixmap_priv->serial, 0, 0, 0, 0,
+                None, None, None, XCB_PRESENT_OPTION_ASYNC, 0, 0, 0, 0, NULL);
+        xcb_flush(present_priv->xcb_connection_bis);
+
+        present_priv->pixmap_present_pending++;
+        present_pixmap_priv->present_complete_pending++;
+        present_pixmap_priv->lfc_idle_skip++;
+        present_priv->lfc_last_ust = now;
+    }
+    SDL_UnlockMutex(present_priv->mutex_present);
+
+    return 0;
+}
+
+static void PRESENTStopLfc(PRESENTpriv *present_priv)
+{
+    if (!present_priv->lfc_thread)
+        return;
+
+    SDL_LockMutex(present_priv->mutex_present);
+    present_priv->lfc_quit = TRUE;
+    SDL_CondSignal(present_priv->lfc_cond);
+    SDL_UnlockMutex(present_priv->mutex_present);
+
+    SDL_WaitThread(present_priv->lfc_thread, NULL);
+    SDL_DestroyCond(present_priv->lfc_cond);
+    present_priv->lfc_thread = NULL;
+    present_priv->lfc_cond = NULL;
+    present_priv->lfc_quit = FALSE;
+}
+
+void PRESENTSetVRR(PRESENTpriv *present_priv, BOOL enable, int min_hz, int max_hz)
+{
+    if (enable && (min_hz <= 0 || max_hz <= min_hz))
+    {
+        WARN("Invalid VRR range %d-%d Hz, VRR pacing disabled\n", min_hz, max_hz);
+        enable = FALSE;
+    }
+
+    SDL_LockMutex(present_priv->mutex_present);
+
+    /* keep the detected state on a Reset that doesn't change anything */
+    if (enable == present_priv->vrr && (!enable ||
+            (present_priv->vrr_min_period == 1000000 / min_hz &&
+             present_priv->vrr_max_period == 1000000 / max_hz)))
+    {
+        SDL_UnlockMutex(present_priv->mutex_present);
+        return;
+    }
+
+    if (!enable)
+    {
+        /* the LFC thread needs the mutex to quit */
+        SDL_UnlockMutex(present_priv->mutex_present);
+        PRESENTStopLfc(present_priv);
+        SDL_LockMutex(present_priv->mutex_present);
+    }
+
+    present_priv->vrr = enable;
+    present_priv->vrr_state = VRR_DETECTING;
+    present_priv->vrr_samples = 0;
+    present_priv->vrr_unaligned = 0;
+    present_priv->frame_interval = 0;
+    present_priv->lfc_pixmap = NULL;
+
+    if (enable)
+    {
+        present_priv->vrr_min_period = 1000000 / min_hz;
+        present_priv->vrr_max_period = 1000000 / max_hz;
+        /* stay just under the maximum refresh rate, else the flips are
+         * throttled by the panel and queue up */
+        present_priv->vrr_frame_limit = present_priv->vrr_max_period * 103 / 100;
+
+        TRACE("VRR pacing for %d-%d Hz\n", min_hz, max_hz);
+
+        if (!present_priv->lfc_thread)
+        {
+            present_priv->lfc_cond = SDL_CreateCond();
+            present_priv->lfc_thread = SDL_CreateThread(PRESENTLfcThread, "D3D9 LFC", present_priv);
+            if (!present_priv->lfc_thread)
+                WARN("Failed to create LFC thread, low framerate compensation disabled\n");
+        }
+    }
+
+    SDL_UnlockMutex(present_priv->mutex_present);
+}
+
+/* Limit the frame rate to just under the panel's maximum */
+static void PRESENTPaceVRR(PRESENTpriv *present_priv)
+{
+    uint64_t deadline = 0, now;
+    struct timespec ts;
+
+    SDL_LockMutex(present_priv->mutex_present);
+    if (present_priv->vrr && present_priv->vrr_state != VRR_INACTIVE &&
+            present_priv->last_submit_ust)
+        deadline = present_priv->last_submit_ust + present_priv->vrr_frame_limit;
+    SDL_UnlockMutex(present_priv->mutex_present);
+
+    now = PRESENTGetUst();
+    if (deadline <= now)
+        return;
+
+    ts.tv_sec = (deadline - now) / 1000000;
+    ts.tv_nsec = ((deadline - now) % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+}
+
 static void PRESENTForceReleases(PRESENTpriv *present_priv)
 {
     PRESENTPixmapPriv *current = NULL;
@@ -331,7 +692,9 @@ static void PRESENTFreeXcbQueue(PRESENTpriv *present_priv)
     {
         xcb_unregister_for_special_event(present_priv->xcb_connection, present_priv->special_event);
         present_priv->last_msc = 0;
+        present_priv->last_ust = 0;
         present_priv->last_target = 0;
+        present_priv->refresh_period = 0;
         present_priv->special_event = NULL;
     }
 }
@@ -345,6 +708,8 @@ static BOOL PRESENTPrivChangeWindow(PRESENTpriv *present_priv, XID window)
     PRESENTForceReleases(present_priv);
     PRESENTFreeXcbQueue(present_priv);
     present_priv->window = window;
+    present_priv->lfc_pixmap = NULL;
+    present_priv->last_submit_ust = 0;
 
     if (window)
     {
@@ -389,6 +754,8 @@ void PRESENTDestroy(PRESENTpriv *present_priv)
 {
     PRESENTPixmapPriv *current = NULL;
 
+    PRESENTStopLfc(present_priv);
+
     SDL_LockMutex(present_priv->mutex_present);
 
     PRESENTForceReleases(present_priv);
@@ -508,6 +875,8 @@ BOOL PRESENTTryFreePixmap(PRESENTPixmapPriv *present_pixmap_priv)
         current = current->next;
     current->next = present_pixmap_priv->next;
 free_priv:
+    if (present_priv->lfc_pixmap == present_pixmap_priv)
+        present_priv->lfc_pixmap = NULL;
     PRESENTDestroyPixmapContent(present_pixmap_priv);
     free(present_pixmap_priv);
     SDL_UnlockMutex(present_priv->mutex_present);
@@ -586,6 +955,10 @@ BOOL PRESENTPixmap(XID window, PRESENTPixmapPriv *present_pixmap_priv,
     xcb_xfixes_region_t valid, update;
     int16_t x_off, y_off;
     uint32_t options = XCB_PRESENT_OPTION_NONE;
+    uint64_t now, target_ust;
+
+    if (PresentationInterval)
+        PRESENTPaceVRR(present_priv);
 
     SDL_LockMutex(present_priv->mutex_present);
 
@@ -599,6 +972,36 @@ BOOL PRESENTPixmap(XID window, PRESENTPixmapPriv *present_pixmap_priv,
 
     target_msc += presentationInterval * (present_priv->pixmap_present_pending + 1);
 
+    /* a requested vblank time overrides the interval, PRESENT targets the
+     * window's CRTC counter, so convert it with the measured timing */
+    target_ust = present_priv->target_ust;
+    if (present_priv->target_ust)
+    {
+        if (present_priv->refresh_period && present_priv->last_ust)
+        {
+            if (present_priv->target_ust > present_priv->last_ust)
+                target_msc = present_priv->last_msc +
+                        (present_priv->target_ust - present_priv->last_ust +
+                         present_priv->refresh_period / 2) / present_priv->refresh_period;
+            else
+                target_msc = present_priv->last_msc;
+        }
+        present_priv->target_ust = 0;
+    }
+
+    /* Adaptive vsync: when the frame already missed the vblank it targets,
+     * tear instead of waiting for the next one (no drop to half the rate) */
+    if (present_priv->adaptive_sync && presentationInterval &&
+            !(options & XCB_PRESENT_OPTION_ASYNC) &&
+            PRESENTIsTargetLate(present_priv, target_msc))
+    {
+        options |= XCB_PRESENT_OPTION_ASYNC;
+    }
+
+    /* With VRR the panel refreshes when the flip arrives */
+    if (present_priv->vrr && present_priv->vrr_state == VRR_ACTIVE)
+        options |= XCB_PRESENT_OPTION_ASYNC;
+
     /* Note: PRESENT defines some way to do partial copy:
      * presentproto:
      * 'x-off' and 'y-off' define the location in the window where
@@ -635,12 +1038,29 @@ BOOL PRESENTPixmap(XID window, PRESENTPixmapPriv *present_pixmap_priv,
         }
         if (pDestRect)
         {
+            int dest_width = pDestRect->right - pDestRect->left;
+            int dest_height = pDestRect->bottom - pDestRect->top;
+
             x_off += pDestRect->left;
             y_off += pDestRect->top;
-            rect_update.width = pDestRect->right - pDestRect->left;
-            rect_update.height = pDestRect->bottom - pDestRect->top;
-            /* Note: the size of pDestRect and pSourceRect are supposed to be the same size
-             * because the driver would have done things to assure that. */
+            /* Note: PRESENT can't scale. Nine scales into a window sized buffer
+             * when the window doesn't match the back buffer, so different sizes
+             * are rare. Present the common part then. */
+            if (dest_width != rect_update.width || dest_height != rect_update.height)
+            {
+                static BOOL once;
+
+                if (!once)
+                {
+                    once = TRUE;
+                    FIXME("Scaling from %dx%d to %dx%d is not supported\n",
+                          rect_update.width, rect_update.height, dest_width, dest_height);
+                }
+                if (dest_width < rect_update.width)
+                    rect_update.width = dest_width;
+                if (dest_height < rect_update.height)
+                    rect_update.height = dest_height;
+            }
         }
         valid = xcb_generate_id(present_priv->xcb_connection_bis);
         update = xcb_generate_id(present_priv->xcb_connection_bis);
@@ -657,7 +1077,7 @@ BOOL PRESENTPixmap(XID window, PRESENTPixmapPriv *present_pixmap_priv,
                 rect_update.y = rc.top;
                 rect_update.width = rc.right - rc.left;
                 rect_update.height = rc.bottom - rc.top;
-                memcpy(rect_updates + i * sizeof(xcb_rectangle_t), &rect_update, sizeof(xcb_rectangle_t));
+                rect_updates[i] = rect_update;
             }
             xcb_xfixes_create_region(present_priv->xcb_connection_bis, update, pDirtyRegion->rdh.nCount, rect_updates);
             free(rect_updates);
@@ -709,9 +1129,28 @@ BOOL PRESENTPixmap(XID window, PRESENTPixmapPriv *present_pixmap_priv,
         return FALSE;
     }
     present_priv->last_target = target_msc;
+    present_pixmap_priv->target_ust = target_ust;
     present_priv->pixmap_present_pending++;
     present_pixmap_priv->present_complete_pending++;
     present_pixmap_priv->released = FALSE;
+
+    if (present_priv->vrr)
+    {
+        now = PRESENTGetUst();
+        if (present_priv->last_submit_ust)
+        {
+            if (present_priv->frame_interval)
+                present_priv->frame_interval = (present_priv->frame_interval * 3 +
+                        now - present_priv->last_submit_ust) / 4;
+            else
+                present_priv->frame_interval = now - present_priv->last_submit_ust;
+        }
+        present_priv->last_submit_ust = now;
+        present_priv->lfc_last_ust = now;
+        present_priv->lfc_pixmap = present_pixmap_priv;
+        if (present_priv->lfc_cond)
+            SDL_CondSignal(present_priv->lfc_cond);
+    }
     SDL_UnlockMutex(present_priv->mutex_present);
     return TRUE;
 }
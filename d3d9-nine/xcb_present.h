@@ -11,6 +11,7 @@
 
 #include <d3d9types.h>
 #include <X11/Xlib.h>
+#include <stdint.h>
 
 LONG PRESENTGetNewSerial(void);
 
@@ -21,6 +22,25 @@ typedef struct PRESENTPixmapPriv PRESENTPixmapPriv;
 
 BOOL PRESENTInit(Display *dpy, PRESENTpriv **present_priv);
 
+/* present synced, but switch single frames to async when they are late */
+void PRESENTSetAdaptiveSync(PRESENTpriv *present_priv, BOOL enable);
+
+/* pace presents for a variable refresh rate panel with the given range */
+void PRESENTSetVRR(PRESENTpriv *present_priv, BOOL enable, int min_hz, int max_hz);
+
+/* UST (CLOCK_MONOTONIC in us) of the vblank the next present would hit */
+uint64_t PRESENTGetNextVblankUst(PRESENTpriv *present_priv, UINT PresentationInterval);
+
+/* present the next pixmap on the vblank closest to target_ust */
+void PRESENTSetTargetUst(PRESENTpriv *present_priv, uint64_t target_ust);
+
+/* number of completed presents that were flipped and copied */
+void PRESENTGetFlipStats(PRESENTpriv *present_priv, unsigned *flips, unsigned *copies);
+
+/* requested and actual time of the oldest completed present that had a
+ * target and wasn't returned yet, FALSE if there is none */
+BOOL PRESENTGetTimedComplete(PRESENTpriv *present_priv, uint64_t *target_ust, uint64_t *ust);
+
 /* will clean properly and free all PRESENTPixmapPriv associated to PRESENTpriv.
  * PRESENTPixmapPriv should not be freed by something else.
  * If never a PRESENTPixmapPriv has to be destroyed,
@@ -3,6 +3,7 @@
 #define __NINE_D3D9_SDL_H
 
 #include <d3d9.h>
+#include <stddef.h>
 
 #define D3DCREATE_NOWINDOWCHANGES 0x00000800
 
@@ -47,6 +48,79 @@ D3DPERF_SetRegion( D3DCOLOR color,
 void WINAPI
 DebugSetMute( void );
 
+/* Optional: start loading the driver on a background thread, e.g. right
+ * after SDL_Init(), so Direct3DCreate9 doesn't have to wait for it. */
+void WINAPI
+D3D9SDL_Preload( void );
+
+typedef struct _D3D9SDL_SYNCSTATS
+{
+    UINT Frames;        /* frames released to all members together */
+    UINT Timeouts;      /* frames released without waiting for every member */
+    UINT64 LastSkew;    /* spread of the flips of a frame, in ns */
+    UINT64 MaxSkew;
+    UINT64 AverageSkew;
+} D3D9SDL_SYNCSTATS;
+
+/* Windows in the same sync group flip on the same vblank: the frame of a
+ * Present is held until every member of the group has one, then all of them
+ * are submitted. Present doesn't wait, so one thread can drive all members.
+ * Group 0 leaves the group, releasing the window's swapchain does as well. */
+BOOL WINAPI
+D3D9SDL_SetPresentSyncGroup( HWND window,
+                             UINT group );
+
+BOOL WINAPI
+D3D9SDL_GetPresentSyncStats( UINT group,
+                             D3D9SDL_SYNCSTATS *stats );
+
+typedef struct _D3D9SDL_TIMINGSTATS
+{
+    UINT Frames;        /* completed presents that had a target time */
+    UINT64 LastTarget;  /* in ns of CLOCK_MONOTONIC */
+    UINT64 LastActual;  /* when the last of them hit the screen */
+    LONGLONG LastError; /* LastActual - LastTarget, in ns */
+    UINT64 MaxError;    /* largest absolute error, in ns */
+} D3D9SDL_TIMINGSTATS;
+
+/* The next Present to the window is shown on the vblank closest to target,
+ * given in ns of CLOCK_MONOTONIC, instead of after the presentation interval. */
+BOOL WINAPI
+D3D9SDL_SetPresentTime( HWND window,
+                        UINT64 target );
+
+/* Updated when a timed present completes, which is noticed on the
+ * window's next Present. */
+BOOL WINAPI
+D3D9SDL_GetPresentTimingStats( HWND window,
+                               D3D9SDL_TIMINGSTATS *stats );
+
+typedef struct _D3D9SDL_FLIPSTATS
+{
+    UINT Flips;         /* completed presents scanned out directly */
+    UINT Copies;        /* completed presents copied by the X server or compositor */
+    UINT CopyStreak;    /* copies since the last flip */
+} D3D9SDL_FLIPSTATS;
+
+/* Counts the presents to the window while a swapchain uses it. Updated on
+ * the window's next Present after they completed. */
+BOOL WINAPI
+D3D9SDL_GetPresentFlipStats( HWND window,
+                             D3D9SDL_FLIPSTATS *stats );
+
+typedef void (WINAPI *D3D9SDL_FRAMECALLBACK)( const void *data,
+                                              UINT width,
+                                              UINT height,
+                                              UINT pitch,
+                                              void *user );
+
+/* With D3D_BACKEND=headless, presented frames are read back and passed to
+ * the callback instead of being shown. Without a callback they are
+ * discarded. The data is only valid during the call. */
+BOOL WINAPI
+D3D9SDL_SetFrameCallback( D3D9SDL_FRAMECALLBACK callback,
+                          void *user );
+
 #ifdef __cplusplus
 };
 #endif
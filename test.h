@@ -0,0 +1,32 @@
+/* Checks shared by the tests, each test is a single source file */
+
+#ifndef __NINE_TEST_H
+#define __NINE_TEST_H
+
+#include <stdio.h>
+
+static int failures;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+/* reports the result, returns the exit code of the test */
+static inline int test_result(void)
+{
+    if (failures)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("All checks passed\n");
+    return 0;
+}
+
+#endif /* __NINE_TEST_H */
@@ -0,0 +1,214 @@
+#include <d3d9types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "d3d9-nine/backend.h"
+#include "test.h"
+
+/* Checks the D3D_PRIME parsing and device ordering on a fake device list,
+ * and the device the adapter group is created on with a mock backend.
+ *
+ * Usage: sdl-nine-test-backend
+ */
+
+static void fake_devices(struct dri_device *devs)
+{
+    static const struct dri_device list[] = {
+        { "/dev/dri/renderD129", "pci-0000_01_00_0", 0x10de, 0x1c8d, FALSE },
+        { "/dev/dri/renderD128", "pci-0000_00_02_0", 0x8086, 0x3e9b, TRUE },
+        { "/dev/dri/renderD130", "pci-0000_05_00_0", 0x1002, 0x73bf, FALSE },
+        { "/dev/dri/renderD131", "platform-vgem", 0, 0, FALSE },
+    };
+
+    memcpy(devs, list, sizeof(list));
+}
+
+static void test_matches(void)
+{
+    struct dri_device devs[4];
+
+    fake_devices(devs);
+
+    CHECK(backend_device_matches(&devs[0], 0, "pci-0000_01_00_0"));
+    CHECK(!backend_device_matches(&devs[1], 1, "pci-0000_01_00_0"));
+    CHECK(!backend_device_matches(&devs[0], 0, "pci-0000_01_00"));
+    CHECK(backend_device_matches(&devs[3], 3, "platform-vgem"));
+    CHECK(!backend_device_matches(&devs[3], 3, "platform-vge"));
+
+    CHECK(backend_device_matches(&devs[0], 0, "10de:1c8d"));
+    CHECK(backend_device_matches(&devs[2], 2, "1002:73BF"));
+    CHECK(!backend_device_matches(&devs[1], 1, "10de:1c8d"));
+
+    CHECK(backend_device_matches(&devs[2], 2, "2"));
+    CHECK(!backend_device_matches(&devs[2], 2, "1"));
+    CHECK(!backend_device_matches(&devs[1], 1, "1x"));
+    CHECK(!backend_device_matches(&devs[0], 0, "nvidia"));
+}
+
+static void test_order(void)
+{
+    struct dri_device devs[4];
+
+    /* the default device comes first */
+    fake_devices(devs);
+    backend_order_devices(devs, 4, NULL);
+    CHECK(!strcmp(devs[0].tag, "pci-0000_00_02_0"));
+    CHECK(devs[0].is_default);
+
+    /* 1 is the first device that isn't the default */
+    fake_devices(devs);
+    backend_order_devices(devs, 4, "1");
+    CHECK(!strcmp(devs[0].tag, "pci-0000_01_00_0"));
+
+    fake_devices(devs);
+    backend_order_devices(devs, 4, "pci-0000_05_00_0");
+    CHECK(!strcmp(devs[0].tag, "pci-0000_05_00_0"));
+
+    fake_devices(devs);
+    backend_order_devices(devs, 4, "1002:73bf");
+    CHECK(!strcmp(devs[0].tag, "pci-0000_05_00_0"));
+
+    fake_devices(devs);
+    backend_order_devices(devs, 4, "platform-vgem");
+    CHECK(!strcmp(devs[0].tag, "platform-vgem"));
+
+    /* no match keeps the default device */
+    fake_devices(devs);
+    backend_order_devices(devs, 4, "pci-0000_09_00_0");
+    CHECK(!strcmp(devs[0].tag, "pci-0000_00_02_0"));
+
+    fake_devices(devs);
+    backend_order_devices(devs, 4, "");
+    CHECK(!strcmp(devs[0].tag, "pci-0000_00_02_0"));
+
+    /* no default device, the scan order stays */
+    fake_devices(devs);
+    devs[1].is_default = FALSE;
+    backend_order_devices(devs, 4, NULL);
+    CHECK(!strcmp(devs[0].tag, "pci-0000_01_00_0"));
+}
+
+/* a backend on the fake devices that can't be created on broken_tag */
+struct mock_priv
+{
+    struct dri_device device;
+};
+
+static const char *broken_tag;
+
+static BOOL mock_probe(Display *dpy)
+{
+    return TRUE;
+}
+
+static int mock_enumerate(Display *dpy, int screen, struct dri_device *devices, int max)
+{
+    if (max < 4)
+        return 0;
+
+    fake_devices(devices);
+    return 4;
+}
+
+static BOOL mock_create(Display *dpy, int screen, const struct dri_device *device,
+        struct dri_backend_priv **priv)
+{
+    struct mock_priv *p;
+
+    if (device && broken_tag && !strcmp(device->tag, broken_tag))
+        return FALSE;
+
+    p = calloc(1, sizeof(*p));
+    if (!p)
+        return FALSE;
+
+    /* NULL is the default device */
+    if (device)
+        p->device = *device;
+    else
+        strcpy(p->device.tag, "default");
+
+    *priv = (struct dri_backend_priv *)p;
+    return TRUE;
+}
+
+static void mock_destroy(struct dri_backend_priv *priv)
+{
+    free(priv);
+}
+
+static const struct dri_backend_funcs mock_funcs = {
+    .name = "mock",
+    .probe = mock_probe,
+    .enumerate = mock_enumerate,
+    .create = mock_create,
+    .destroy = mock_destroy,
+};
+
+static const struct dri_backend_funcs mock_default_funcs = {
+    .name = "mock-default",
+    .probe = mock_probe,
+    .create = mock_create,
+    .destroy = mock_destroy,
+};
+
+static const struct dri_backend_funcs *const mock_backends[] = { &mock_funcs };
+static const struct dri_backend_funcs *const mock_default_backends[] = { &mock_default_funcs };
+
+/* the tag of the device fill_groups' backend is created on, with prime as D3D_PRIME */
+static BOOL created_on(const char *prime, const char *tag)
+{
+    struct dri_backend *dri_backend;
+    BOOL ret;
+
+    if (prime)
+        setenv("D3D_PRIME", prime, 1);
+    else
+        unsetenv("D3D_PRIME");
+
+    dri_backend = backend_create_selected(NULL, 0);
+    if (!dri_backend)
+        return tag == NULL;
+
+    ret = tag && !strcmp(((struct mock_priv *)dri_backend->priv)->device.tag, tag);
+    backend_destroy(dri_backend);
+    return ret;
+}
+
+static void test_create_selected(void)
+{
+    unsetenv("D3D_BACKEND");
+    backend_set_funcs(mock_backends, 1);
+
+    CHECK(created_on(NULL, "pci-0000_00_02_0"));
+    CHECK(created_on("1", "pci-0000_01_00_0"));
+    CHECK(created_on("1002:73bf", "pci-0000_05_00_0"));
+    CHECK(created_on("platform-vgem", "platform-vgem"));
+    CHECK(created_on("pci-0000_09_00_0", "pci-0000_00_02_0"));
+
+    /* a device that fails falls back to the default one */
+    broken_tag = "pci-0000_05_00_0";
+    CHECK(created_on("pci-0000_05_00_0", "default"));
+
+    /* as does the default device itself */
+    broken_tag = "pci-0000_00_02_0";
+    CHECK(created_on(NULL, NULL));
+    broken_tag = NULL;
+
+    /* backends without enumerate only get the default device */
+    backend_set_funcs(mock_default_backends, 1);
+    CHECK(created_on("1", "default"));
+
+    backend_set_funcs(NULL, 0);
+    unsetenv("D3D_PRIME");
+}
+
+int main(int argc, char *argv[])
+{
+    test_matches();
+    test_order();
+    test_create_selected();
+
+    return test_result();
+}
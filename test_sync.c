@@ -0,0 +1,159 @@
+#include <d3d9.h>
+#include <d3d9_sdl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "d3d9-nine/sync.h"
+#include "test.h"
+
+/* Drives two members of a present sync group from one thread against a
+ * simulated vblank clock and checks the frames are released together.
+ *
+ * Usage: sdl-nine-test-sync
+ */
+
+#define PERIOD 16667 /* us, 60 Hz */
+#define FRAMES 100
+
+struct sim_head
+{
+    HWND hwnd;
+    uint64_t phase; /* of its CRTC's vblanks, in us */
+    unsigned submitted;
+    uint64_t last_target;
+};
+
+struct sim_frame
+{
+    struct sync_frame sync;
+    struct sim_head *head;
+};
+
+/* the first vblank of the head at or after ust */
+static uint64_t sim_next_vblank(const struct sim_head *head, uint64_t ust)
+{
+    if (ust <= head->phase)
+        return head->phase;
+    return head->phase + (ust - head->phase + PERIOD - 1) / PERIOD * PERIOD;
+}
+
+/* PRESENTPixmap flips on the vblank closest to the target */
+static uint64_t sim_flip(const struct sim_head *head, uint64_t target_ust)
+{
+    if (target_ust <= head->phase)
+        return head->phase;
+    return head->phase + (target_ust - head->phase + PERIOD / 2) / PERIOD * PERIOD;
+}
+
+/* flips right away and reports the complete event like present.c does */
+static void sim_submit(struct sync_frame *sync, uint64_t target_ust)
+{
+    struct sim_frame *frame = (struct sim_frame *)sync;
+    struct sim_head *head = frame->head;
+
+    head->submitted++;
+    head->last_target = target_ust;
+    sync_report_present(head->hwnd, target_ust, sim_flip(head, target_ust));
+
+    free(frame);
+}
+
+static void sim_present(struct sim_head *head, uint64_t now)
+{
+    struct sim_frame *frame = calloc(1, sizeof(*frame));
+    uint64_t target_ust;
+
+    CHECK(sync_begin_present(head->hwnd, &target_ust));
+
+    frame->head = head;
+    frame->sync.hwnd = head->hwnd;
+    frame->sync.owner = head;
+    frame->sync.next_ust = target_ust ? target_ust : sim_next_vblank(head, now);
+    frame->sync.submit = sim_submit;
+
+    if (!sync_queue_frame(&frame->sync))
+        sim_submit(&frame->sync, target_ust);
+}
+
+static void test_one_thread(UINT id, uint64_t phase_b, uint64_t expected_skew)
+{
+    struct sim_head a = { (HWND)(uintptr_t)(id * 2), 0 };
+    struct sim_head b = { (HWND)(uintptr_t)(id * 2 + 1), phase_b };
+    D3D9SDL_SYNCSTATS stats;
+    uint64_t now = PERIOD;
+    int i;
+
+    CHECK(sync_set_group(a.hwnd, id));
+    CHECK(sync_set_group(b.hwnd, id));
+
+    for (i = 0; i < FRAMES; i++, now += PERIOD)
+    {
+        sim_present(&a, now);
+        /* a is held, nothing waits for b */
+        CHECK(a.submitted == i);
+        CHECK(sync_is_held(&a, NULL));
+        CHECK(!sync_is_held(&b, NULL));
+
+        sim_present(&b, now);
+        CHECK(a.submitted == i + 1 && b.submitted == i + 1);
+        CHECK(!sync_is_held(&a, NULL));
+        CHECK(a.last_target == b.last_target);
+    }
+
+    CHECK(sync_get_stats(id, &stats));
+    CHECK(stats.Frames == FRAMES);
+    CHECK(stats.Timeouts == 0);
+    CHECK(stats.LastSkew == expected_skew * 1000);
+    CHECK(stats.MaxSkew == expected_skew * 1000);
+
+    sync_remove_window(a.hwnd);
+    sync_remove_window(b.hwnd);
+}
+
+static void test_stalled_member(void)
+{
+    struct sim_head a = { (HWND)(uintptr_t)100, 0 };
+    struct sim_head b = { (HWND)(uintptr_t)101, 0 };
+    D3D9SDL_SYNCSTATS stats;
+
+    CHECK(sync_set_group(a.hwnd, 10));
+    CHECK(sync_set_group(b.hwnd, 10));
+
+    /* presenting again releases the held frame without b */
+    sim_present(&a, PERIOD);
+    sim_present(&a, 2 * PERIOD);
+    CHECK(a.submitted == 1 && b.submitted == 0);
+
+    /* leaving the group submits the held frame */
+    CHECK(sync_set_group(a.hwnd, 0));
+    CHECK(a.submitted == 2);
+
+    CHECK(sync_get_stats(10, &stats));
+    CHECK(stats.Frames == 0);
+    CHECK(stats.Timeouts == 1);
+
+    /* the only member left isn't held */
+    sim_present(&b, 3 * PERIOD);
+    CHECK(b.submitted == 1);
+
+    /* flushing by owner submits the held frame as well */
+    CHECK(sync_set_group(a.hwnd, 10));
+    sim_present(&a, 4 * PERIOD);
+    CHECK(a.submitted == 2);
+    sync_flush_frames(&a);
+    CHECK(a.submitted == 3);
+
+    sync_remove_window(a.hwnd);
+    sync_remove_window(b.hwnd);
+}
+
+int main(int argc, char *argv[])
+{
+    /* same vblanks, then b's CRTC 250 us behind */
+    test_one_thread(1, 0, 0);
+    test_one_thread(2, 250, 250);
+    test_stalled_member();
+
+    return test_result();
+}